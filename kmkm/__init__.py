@@ -6,6 +6,9 @@
 
 from ._kmkm import (
     PyKmerCounter as KmerCounter,
+    PyExactKmerCounter as ExactKmerCounter,
+    PyHyperLogLog as HyperLogLog,
+    kmer_buckets_for,
     PySeq as Seq,
     PySeqReader as SeqReader,
 )
@@ -14,6 +17,9 @@ from .collection import KmerCollection
 
 __all__ = [
     "KmerCounter",
+    "ExactKmerCounter",
+    "HyperLogLog",
+    "kmer_buckets_for",
     "KmerCollection",
     "Seq",
     "SeqReader",
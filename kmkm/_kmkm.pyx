@@ -9,7 +9,8 @@
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp cimport bool
-from libc.stdint cimport uint8_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
+from libc.math cimport round
 import cython
 from cython.operator import dereference as deref
 cimport numpy as np
@@ -17,12 +18,62 @@ import numpy as np
 import sys
 
 cdef extern from "kmkm.hh" namespace "kmkm":
+    cdef enum HashMode:
+        HASH_INTHASH
+        HASH_NTHASH
+        HASH_DIRECT
+
+    cdef enum CountEngine:
+        ENGINE_DIRECT
+        ENGINE_PARTITIONED
+
+    cdef enum SketchLayout:
+        SKETCH_ROWS
+        SKETCH_BLOCKED
+
+    cdef enum CounterMode:
+        COUNTER_LINEAR
+        COUNTER_PACKED4
+        COUNTER_LOG
+
+    cdef enum ParallelMode:
+        PARALLEL_ATOMIC
+        PARALLEL_SHARDED
+        PARALLEL_RANGE
+
+    cdef cppclass LogCounterTables:
+        double value[256]
+        @staticmethod
+        const LogCounterTables & get()
+
+    cdef cppclass BottomKSketch:
+        const vector[uint64_t] & hashes()
+        const vector[uint64_t] & counts()
+        size_t capacity()
+        double jaccard(const BottomKSketch &other)
+
+    cdef cppclass HyperLogLog:
+        HyperLogLog(unsigned int precision) except +
+        size_t consume_from(const string &filename, int k, bool canonical,
+                            int nthreads) nogil except +
+        double consume_prefix(const string &filename, int k, bool canonical,
+                              size_t max_reads) nogil except +
+        double estimate()
+
+    size_t buckets_for "kmkm::KmerCounter<uint8_t>::buckets_for"(uint64_t distinct_kmers,
+                                                                double collision_rate) except +
+
     cdef cppclass KmerCounter[T]:
         KmerCounter()
         KmerCounter(const string &filename)
-        KmerCounter(int ksize, size_t cvsize, bool canonical, size_t cbf_tables) except +
-        void consume_from(const string &filename) nogil except +
+        KmerCounter(int ksize, size_t cvsize, bool canonical, size_t cbf_tables,
+                    size_t cbf_width) except +
+        size_t consume_from(const string &filename, int nthreads) nogil except +
         void consume(const string &sequence) nogil except +
+        void count_batch(const uint64_t *hashes, size_t n) nogil except +
+        T query(uint64_t hashed_kmer) nogil except +
+        void set_prefetch_distance(size_t distance) except +
+        size_t prefetch_distance() except +
         void clear() except +
         void save(const string &filename) nogil except +
         void load(const string &filename) nogil except +
@@ -30,6 +81,36 @@ cdef extern from "kmkm.hh" namespace "kmkm":
         const T* data() except +
         int k() except +
         size_t nnz() except +
+        void set_hash_mode(HashMode mode) except +
+        HashMode hash_mode() except +
+        void set_scale(uint64_t scale) except +
+        uint64_t scale() except +
+        void set_sketch_size(size_t size) except +
+        const BottomKSketch & sketch()
+        void set_engine(CountEngine engine) except +
+        CountEngine engine() except +
+        void set_sketch_layout(SketchLayout layout) except +
+        void set_overflow(bool enabled) except +
+        void set_counter_mode(CounterMode mode) except +
+        CounterMode counter_mode() except +
+        size_t buckets() except +
+        vector[T] export_counts() except +
+        vector[uint32_t] export_counts_u32 "export_counts<uint32_t>"() except +
+        uint64_t bucket_count(size_t bucket) except +
+        void flush() nogil except +
+        void set_parallel_mode(ParallelMode mode) except +
+
+cdef extern from "kmexact.hh" namespace "kmkm":
+    cdef cppclass ExactKmerCounter "kmkm::ExactKmerCounter<0>":
+        ExactKmerCounter(const string &filename) except +
+        ExactKmerCounter(int ksize, bool canonical) except +
+        size_t consume_from(const string &filename, int nthreads) nogil except +
+        void consume(const string &sequence) nogil except +
+        uint64_t count(const string &kmer) except +
+        size_t size() except +
+        int k() except +
+        void clear() except +
+        void save(const string &filename) nogil except +
 
 cdef extern from "kmseq.hh" namespace "kmseq":
     cdef cppclass KSeq:
@@ -137,42 +218,138 @@ cdef class PySeqReader:
             self.rdr = NULL
 
 
+_HASH_MODES = {
+    "inthash": HASH_INTHASH,
+    "nthash": HASH_NTHASH,
+    "direct": HASH_DIRECT,
+}
+
+_ENGINES = {
+    "direct": ENGINE_DIRECT,
+    "partitioned": ENGINE_PARTITIONED,
+}
+
+_SKETCH_LAYOUTS = {
+    "rows": SKETCH_ROWS,
+    "blocked": SKETCH_BLOCKED,
+}
+
+_COUNTER_MODES = {
+    "linear": COUNTER_LINEAR,
+    "packed4": COUNTER_PACKED4,
+    "log": COUNTER_LOG,
+}
+
+_PARALLEL_MODES = {
+    "atomic": PARALLEL_ATOMIC,
+    "sharded": PARALLEL_SHARDED,
+    "range": PARALLEL_RANGE,
+}
+
 cdef class PyKmerCounter:
     cdef readonly int ksize
     cdef readonly size_t cvsize
     cdef KmerCounterU8 *ctr
 
-    def __init__(self, int ksize = 21, int cvsize = 1000000, bool canonical=True,
-                 int cbf_tables=0, str filename=None):
+    def __init__(self, int ksize = 21, size_t cvsize = 1000000, bool canonical=True,
+                 int cbf_tables=0, str filename=None, str hash_mode="inthash",
+                 str engine="direct", size_t cbf_width=0, str sketch_layout="rows",
+                 bool overflow=False, str counter_mode="linear", uint64_t scale=1,
+                 size_t sketch_size=0):
+        if engine not in _ENGINES:
+            raise ValueError("Unknown counting engine: " + engine)
         if filename is None:
+            if hash_mode not in _HASH_MODES:
+                raise ValueError("Unknown hash mode: " + hash_mode)
+            if sketch_layout not in _SKETCH_LAYOUTS:
+                raise ValueError("Unknown sketch layout: " + sketch_layout)
+            if counter_mode not in _COUNTER_MODES:
+                raise ValueError("Unknown counter mode: " + counter_mode)
             self.ksize = ksize
             self.cvsize = cvsize
             self.ctr = new KmerCounterU8(self.ksize, self.cvsize, canonical,
-                                        cbf_tables)
+                                        cbf_tables, cbf_width)
+            self.ctr.set_hash_mode(_HASH_MODES[hash_mode])
+            self.ctr.set_scale(scale)
+            self.ctr.set_sketch_size(sketch_size)
+            self.ctr.set_sketch_layout(_SKETCH_LAYOUTS[sketch_layout])
+            self.ctr.set_counter_mode(_COUNTER_MODES[counter_mode])
+            # Packed counters round the number of buckets up to even, and
+            # direct indexing has one per k-mer
+            self.cvsize = self.ctr.buckets()
+            self.ctr.set_overflow(overflow or counter_mode == "packed4")
         else:
             self.ctr = new KmerCounterU8(filename.encode('utf-8'))
             self.ksize = self.ctr.k()
-            self.cvsize = self.ctr.counts().size()
+            self.cvsize = self.ctr.buckets()
+        self.ctr.set_engine(_ENGINES[engine])
 
 
     def count_sequences(self, list sequences):
         for seq in sequences:
             assert isinstance(seq, PySeq)
             self.ctr.consume(seq.seq)
+        self.ctr.flush()
+
+    def count_hashes(self, np.uint64_t[::1] hashes):
+        cdef size_t n = hashes.shape[0]
+        if n == 0:
+            return
+        with nogil:
+            self.ctr.count_batch(<const uint64_t *>&hashes[0], n)
+            self.ctr.flush()
+
+    def query(self, uint64_t hashed_kmer):
+        return self.ctr.query(hashed_kmer)
+
+    def bucket_count(self, size_t bucket):
+        if bucket >= self.cvsize:
+            raise IndexError("Bucket out of range")
+        return self.ctr.bucket_count(bucket)
 
-    def count_file(self, str filename):
+    def count_file(self, str filename, int threads=1, str parallel="atomic"):
+        if parallel not in _PARALLEL_MODES:
+            raise ValueError("Unknown parallel mode: " + parallel)
+        self.ctr.set_parallel_mode(_PARALLEL_MODES[parallel])
         fnameenc = filename.encode("utf-8")
         cdef char* fname = fnameenc
+        cdef size_t nreads
         with nogil:
-            self.ctr.consume_from(fname)
+            nreads = self.ctr.consume_from(fname, threads)
+        return nreads
 
     def clear(self):
         self.ctr.clear()
 
-    def counts(self):
-        n = np.asarray(<np.uint8_t[:self.cvsize]>self.ctr.data())
+    def counts(self, bool raw=False):
+        # With raw, log counters return their 8-bit levels, which
+        # log_counter_values() decodes
+        cdef vector[uint8_t] exported
+        cdef vector[uint32_t] estimated
+        if self.ctr.counter_mode() == COUNTER_LINEAR or \
+                (raw and self.ctr.counter_mode() == COUNTER_LOG):
+            n = np.asarray(<np.uint8_t[:self.cvsize]>self.ctr.data())
+        elif self.ctr.counter_mode() == COUNTER_LOG:
+            # Estimated counts need more than 8 bits
+            estimated = self.ctr.export_counts_u32()
+            n = np.asarray(<np.uint32_t[:self.cvsize]>estimated.data()).copy()
+        else:
+            exported = self.ctr.export_counts()
+            n = np.asarray(<np.uint8_t[:self.cvsize]>exported.data()).copy()
         return n.reshape((1, self.cvsize))
 
+    def sketch(self):
+        # Sketched hashes, and their abundances
+        self.ctr.flush()
+        hashes = np.array(self.ctr.sketch().hashes(), dtype=np.uint64)
+        counts = np.array(self.ctr.sketch().counts(), dtype=np.uint64)
+        return hashes, counts
+
+    def jaccard(self, PyKmerCounter other):
+        self.ctr.flush()
+        other.ctr.flush()
+        return self.ctr.sketch().jaccard(other.ctr.sketch())
+
     def save(self, str filename):
         self.ctr.save(filename.encode("utf-8"))
 
@@ -184,3 +361,112 @@ cdef class PyKmerCounter:
     property nnz:
         def __get__(self):
             return self.ctr.nnz()
+
+    property prefetch_distance:
+        def __get__(self):
+            return self.ctr.prefetch_distance()
+        def __set__(self, size_t distance):
+            self.ctr.set_prefetch_distance(distance)
+
+    property scale:
+        def __get__(self):
+            return self.ctr.scale()
+
+    property hash_mode:
+        def __get__(self):
+            mode = self.ctr.hash_mode()
+            for name, val in _HASH_MODES.items():
+                if val == mode:
+                    return name
+
+    property counter_mode:
+        def __get__(self):
+            mode = self.ctr.counter_mode()
+            for name, val in _COUNTER_MODES.items():
+                if val == mode:
+                    return name
+
+
+def kmer_buckets_for(uint64_t distinct_kmers, double collision_rate):
+    return buckets_for(distinct_kmers, collision_rate)
+
+
+def log_counter_values():
+    # Count estimated by each level of a log counter, as in counts()
+    cdef int v
+    return np.array([round(LogCounterTables.get().value[v]) for v in range(256)],
+                    dtype=np.uint32)
+
+
+cdef class PyHyperLogLog:
+    cdef HyperLogLog *hll
+
+    def __init__(self, unsigned int precision=14):
+        self.hll = new HyperLogLog(precision)
+
+    def count_file(self, str filename, int ksize=21, bool canonical=True, int threads=1):
+        fnameenc = filename.encode("utf-8")
+        cdef char* fname = fnameenc
+        cdef size_t nreads
+        with nogil:
+            nreads = self.hll.consume_from(fname, ksize, canonical, threads)
+        return nreads
+
+    def count_prefix(self, str filename, size_t max_reads, int ksize=21, bool canonical=True):
+        # Fraction of the file read; divide estimate() by it to extrapolate
+        fnameenc = filename.encode("utf-8")
+        cdef char* fname = fnameenc
+        cdef double frac
+        with nogil:
+            frac = self.hll.consume_prefix(fname, ksize, canonical, max_reads)
+        return frac
+
+    def estimate(self):
+        return self.hll.estimate()
+
+    def __dealloc__(self):
+        if self.hll is not NULL:
+            del self.hll
+            self.hll = NULL
+
+
+cdef class PyExactKmerCounter:
+    cdef readonly int ksize
+    cdef ExactKmerCounter *ctr
+
+    def __init__(self, int ksize = 21, bool canonical=True, str filename=None):
+        if filename is None:
+            self.ctr = new ExactKmerCounter(ksize, canonical)
+        else:
+            self.ctr = new ExactKmerCounter(filename.encode('utf-8'))
+        self.ksize = self.ctr.k()
+
+    def count_sequences(self, list sequences):
+        for seq in sequences:
+            assert isinstance(seq, PySeq)
+            self.ctr.consume(seq.seq)
+
+    def count_file(self, str filename, int threads=1):
+        fnameenc = filename.encode("utf-8")
+        cdef char* fname = fnameenc
+        cdef size_t nreads
+        with nogil:
+            nreads = self.ctr.consume_from(fname, threads)
+        return nreads
+
+    def count(self, str kmer):
+        return self.ctr.count(kmer.encode("utf-8"))
+
+    def clear(self):
+        self.ctr.clear()
+
+    def save(self, str filename):
+        self.ctr.save(filename.encode("utf-8"))
+
+    def __len__(self):
+        return self.ctr.size()
+
+    def __dealloc__(self):
+        if self.ctr is not NULL:
+            del self.ctr
+            self.ctr = NULL
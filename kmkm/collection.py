@@ -16,7 +16,7 @@ from concurrent.futures import as_completed, ThreadPoolExecutor
 from os.path import basename, exists, isdir
 import shutil
 
-from ._kmkm import PyKmerCounter as KmerCounter
+from ._kmkm import PyKmerCounter as KmerCounter, log_counter_values
 from .logger import LOGGER as LOG, enable_logging
 
 
@@ -62,6 +62,18 @@ class KmerCollection(object):
     def samples(self, samps):
         self.array.attrs["samples"] = samps
 
+    @property
+    def counter_mode(self):
+        # Collections from before log counters hold linear counts
+        return self.array.attrs.get("counter_mode", "linear")
+
+    def counts(self, rows=slice(None)):
+        """Counts of the given rows (samples), decoding log counter levels"""
+        stored = self.array[rows]
+        if self.counter_mode == "log":
+            return log_counter_values()[stored]
+        return stored
+
 
     def set_countparams(self, ksize=21, cvsize=2**20, cbf_tables=1):
         self.ksize = ksize
@@ -86,7 +98,13 @@ class KmerCollection(object):
         self.add_counter(kmr, filename)
 
     def add_counter(self, kmr, samplename):
-        self.add_counts(kmr.counts(), samplename)
+        # Log counters are stored as their 8-bit levels, and decoded by
+        # counts(), so all samples must share a counter mode
+        if not self.samples:
+            self.array.attrs["counter_mode"] = kmr.counter_mode
+        elif kmr.counter_mode != self.counter_mode:
+            raise ValueError("Counter mode mismatch at " + samplename)
+        self.add_counts(kmr.counts(raw=True), samplename)
 
     def add_counts(self, countvec, samplename):
         nrow, ncol = self.array.shape
@@ -9,7 +9,11 @@ from click import (
     Path,
 )
 
-from ._kmkm import PyKmerCounter as KmerCounter
+from ._kmkm import (
+    PyKmerCounter as KmerCounter,
+    PyHyperLogLog as HyperLogLog,
+    kmer_buckets_for,
+)
 from .collection import KmerCollection
 from .logger import LOGGER as LOG, enable_logging, DEBUG
 
@@ -31,16 +35,49 @@ def main():
 @click.argument('outfile', required=True, type=Path())
 @click.argument('seqfiles', nargs=-1, required=True, type=Path(exists=True))
 @click.option('-k','--ksize', default=21, type=int)
-@click.option('-c', '--cvsize', default=100000000, type=int)
+@click.option('-c', '--cvsize', default="100000000",
+              help="Number of buckets, or 'auto' to size for --collision-rate")
+@click.option('-r', '--collision-rate', default=0.1, type=float)
+@click.option('--prepass-reads', default=0, type=int,
+              help="Estimate k-mers for --cvsize auto from the first reads of each "
+                   "file, extrapolated to the whole file by size")
+@click.option('-t', '--threads', default=1, type=int)
+@click.option('-p', '--parallel', default="atomic",
+              type=click.Choice(["atomic", "sharded", "range"]))
+@click.option('-s', '--scale', default=1, type=int)
 @click.option('-v', '--verbose', count=True)
 @click.option('-q', '--quiet', default=False)
-def count_file(outfile, seqfiles, ksize, cvsize, quiet, verbose):
+def count_file(outfile, seqfiles, ksize, cvsize, collision_rate, prepass_reads, threads,
+               parallel, scale, quiet, verbose):
     handle_logging_args(verbose, quiet)
+    if cvsize == "auto":
+        LOG.info("Estimating distinct k-mers...")
+        hll = HyperLogLog()
+        kmers = 0
+        for sf in seqfiles:
+            if prepass_reads > 0:
+                # Distinct k-mers grow more slowly than reads, so this errs
+                # towards too many buckets
+                prefix = HyperLogLog()
+                frac = prefix.count_prefix(sf, prepass_reads, ksize)
+                kmers += prefix.estimate() / frac
+            else:
+                hll.count_file(sf, ksize, threads=threads)
+        kmers += hll.estimate()
+        # Only about one in scale k-mers is counted
+        kmers /= scale
+        cvsize = kmer_buckets_for(int(kmers), collision_rate)
+        LOG.info("About {:.0f} distinct k-mers, using {} buckets".format(kmers, cvsize))
+    else:
+        try:
+            cvsize = int(cvsize)
+        except ValueError:
+            raise click.BadParameter("must be an integer or 'auto'", param_hint="--cvsize")
     LOG.info("Counting files...")
-    kc = KmerCounter(ksize, cvsize)
+    kc = KmerCounter(ksize, cvsize, scale=scale)
     for sf in seqfiles:
         LOG.info("\t" + sf)
-        kc.count_file(sf)
+        kc.count_file(sf, threads=threads, parallel=parallel)
     LOG.info("Saving to " + outfile)
     kc.save(outfile)
     LOG.info("All done!")
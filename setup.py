@@ -2,6 +2,7 @@
 from setuptools import setup, Extension
 from Cython.Build import cythonize
 import numpy as np
+import os
 
 inst_deps = [
     'zarr',
@@ -10,6 +11,13 @@ inst_deps = [
     'numpy',
 ]
 
+# Portable by default: nucleotide encoding picks SSSE3/AVX2 at run time.
+# KMKM_NATIVE=1 builds for the host CPU, which also enables the AVX2 table
+# probe, but the extension may not run on other CPUs.
+compile_args = ['-std=c++14', '-fopenmp', ]
+if os.environ.get('KMKM_NATIVE', '0') == '1':
+    compile_args.append('-march=native')
+
 
 setup(
     name="kmkm",
@@ -18,7 +26,8 @@ setup(
         "kmkm._kmkm",
         sources=["kmkm/_kmkm.pyx", ],
         include_dirs=["src", "src/ext", np.get_include()],
-        extra_compile_args=['-std=c++14', ],
+        extra_compile_args=compile_args,
+        extra_link_args=['-fopenmp', ],
         libraries=['boost_serialization', 'boost_system', 'boost_filesystem',
                    'boost_iostreams', 'z'],
         language="c++",)),
@@ -0,0 +1,57 @@
+// Copyright (c) 2017 Kevin Murray <kdmfoss@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// Benchmarks KmerCounter::consume() on random reads.
+//
+// Usage: bench_count [cvsize] [nreads]
+
+#include <chrono>
+#include <cstdlib>
+#include "kmkm.hh"
+
+using namespace kmkm;
+using namespace std;
+
+template <typename Setup>
+double bench(const string &name, const vector<string> &reads, size_t cvsize, Setup setup)
+{
+    KmerCounter<uint8_t> ctr(21, cvsize);
+    setup(ctr);
+    size_t nkmers = 0;
+    for (const auto &read: reads) nkmers += read.size() - 21 + 1;
+
+    auto start = chrono::steady_clock::now();
+    ctr.consume(reads);
+    chrono::duration<double> secs = chrono::steady_clock::now() - start;
+
+    const double rate = nkmers / secs.count() / 1e6;
+    cout << name << "\t" << secs.count() << "s\t" << rate << " Mkmer/s" << endl;
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t cvsize = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000000;
+    const size_t nreads = argc > 2 ? strtoull(argv[2], nullptr, 10) : 500000;
+
+    vector<string> reads(nreads);
+    uint64_t state = 1;
+    for (auto &read: reads) {
+        read.resize(150);
+        for (auto &c: read) c = "ACGT"[(state = inthash64(state + 1)) % 4];
+    }
+    cout << "cvsize " << cvsize << ", " << nreads << " reads of 150bp" << endl;
+
+    for (size_t dist: {0, 2, 4, 8, 16, 32, 64}) {
+        bench("prefetch " + to_string(dist), reads, cvsize,
+              [dist](KmerCounter<uint8_t> &ctr) { ctr.set_prefetch_distance(dist); });
+    }
+    bench("partitioned", reads, cvsize,
+          [](KmerCounter<uint8_t> &ctr) { ctr.set_engine(ENGINE_PARTITIONED); });
+    return 0;
+}
+
+// vim:set et sw=4 ts=4:
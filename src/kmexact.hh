@@ -0,0 +1,1064 @@
+// Copyright (c) 2017 Kevin Murray <kdmfoss@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef KMEXACT_HH_Q3RZ8V1D
+#define KMEXACT_HH_Q3RZ8V1D
+
+#include <mutex>
+
+#include <boost/filesystem.hpp>
+
+#include "kmkm.hh"
+
+using namespace std;
+
+namespace kmkm {
+
+
+/**********************************************************************
+*                          ExactKmerTable                            *
+**********************************************************************/
+
+/*! \class ExactKmerTable
+ *  \brief Open-addressing table of exact counts of hashed k-mers
+ *
+ *  Keys are inthash64() values of k-mers, which are uniformly mixed and,
+ *  for k <= 32, unique to each k-mer. Slots are probed linearly in groups of
+ *  four, and each group fills from its first slot, so one look at a group
+ *  finds either the key or the free slot it belongs in. In builds targeting
+ *  AVX2 (NATIVE=1), that look is two vector comparisons. Key 0 marks a free
+ *  slot, so the one k-mer hashing to 0 is counted separately. The table
+ *  doubles in size once it is more than max_load full.
+ */
+class ExactKmerTable
+{
+public:
+    ExactKmerTable(size_t capacity = 64)
+        : _size(0)
+        , _zero(0)
+    {
+        size_t ngroups = 1;
+        while (ngroups * group_size < capacity) ngroups *= 2;
+        _keys.assign(ngroups * group_size, 0);
+        _counts.assign(ngroups * group_size, 0);
+        _group_mask = ngroups - 1;
+    }
+
+    /*! \brief Adds n to the count of key, saturating at 2^32 - 1 */
+    inline void add(uint64_t key, uint32_t n = 1)
+    {
+        if (key == 0) {
+            _zero += n;
+            return;
+        }
+        const size_t slot = this->find_slot(key);
+        if (_keys[slot] == key) {
+            const uint64_t sum = uint64_t(_counts[slot]) + n;
+            _counts[slot] = uint32_t(min(sum, uint64_t(numeric_limits<uint32_t>::max())));
+            return;
+        }
+        _keys[slot] = key;
+        _counts[slot] = n;
+        if (++_size > _keys.size() * max_load) {
+            this->grow();
+        }
+    }
+
+    inline uint64_t get(uint64_t key) const
+    {
+        if (key == 0) return _zero;
+        const size_t slot = this->find_slot(key);
+        return _keys[slot] == key ? _counts[slot] : 0;
+    }
+
+    /*! \brief Number of distinct keys */
+    inline size_t size() const
+    {
+        return _size + (_zero > 0);
+    }
+
+    inline size_t capacity() const
+    {
+        return _keys.size();
+    }
+
+    /*! \brief Calls fn(key, count) for each key in the table, in no order */
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        if (_zero > 0) fn(uint64_t(0), _zero);
+        for (size_t i = 0; i < _keys.size(); i++) {
+            if (_keys[i] != 0) fn(_keys[i], uint64_t(_counts[i]));
+        }
+    }
+
+    void clear()
+    {
+        std::fill(_keys.begin(), _keys.end(), 0);
+        std::fill(_counts.begin(), _counts.end(), 0);
+        _size = 0;
+        _zero = 0;
+    }
+
+    static constexpr size_t group_size = 4;
+    static constexpr double max_load = 0.75;
+
+protected:
+    /* Slot holding key, or the free slot key would be inserted in */
+    inline size_t find_slot(uint64_t key) const
+    {
+        size_t group = key & _group_mask;
+        while (true) {
+            const uint64_t *keys = _keys.data() + group * group_size;
+#ifdef __AVX2__
+            const __m256i slots = _mm256_load_si256(reinterpret_cast<const __m256i *>(keys));
+            const __m256i hit = _mm256_cmpeq_epi64(slots, _mm256_set1_epi64x(key));
+            const __m256i empty = _mm256_cmpeq_epi64(slots, _mm256_setzero_si256());
+            const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(hit, empty)));
+            if (mask != 0) {
+                return group * group_size + __builtin_ctz(mask);
+            }
+#else
+            for (size_t i = 0; i < group_size; i++) {
+                if (keys[i] == key || keys[i] == 0) return group * group_size + i;
+            }
+#endif
+            group = (group + 1) & _group_mask;
+        }
+    }
+
+    void grow()
+    {
+        ExactKmerTable bigger(_keys.size() * 2);
+        for (size_t i = 0; i < _keys.size(); i++) {
+            if (_keys[i] != 0) {
+                const size_t slot = bigger.find_slot(_keys[i]);
+                bigger._keys[slot] = _keys[i];
+                bigger._counts[slot] = _counts[i];
+            }
+        }
+        _keys.swap(bigger._keys);
+        _counts.swap(bigger._counts);
+        _group_mask = bigger._group_mask;
+    }
+
+    // Aligned so that each group is one AVX2 load
+    vector<uint64_t, boost::alignment::aligned_allocator<uint64_t, 32>> _keys;
+    vector<uint32_t> _counts;
+    size_t _group_mask;
+    size_t _size;
+    uint64_t _zero;
+
+    // Serialization
+    friend class boost::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */)
+    {
+        ar & _keys;
+        ar & _counts;
+        ar & _group_mask;
+        ar & _size;
+        ar & _zero;
+    }
+};
+
+
+/**********************************************************************
+*                         ExactKmerCounter                           *
+**********************************************************************/
+
+/*! \class ExactKmerCounter
+ *  \brief Exact k-mer counter, for k up to 32
+ *
+ *  Counts every distinct k-mer separately, in shard_count ExactKmerTables
+ *  picked by the top bits of the k-mer's hash. consume_from() counts on
+ *  several threads, which lock one shard at a time to insert a batch of
+ *  k-mers into it. Shards grow independently, so growing one never stalls
+ *  threads inserting into others.
+ *
+ *  If K is non-zero, k-mers are iterated with k fixed at compile time.
+ */
+template <unsigned int K = 0>
+class ExactKmerCounter
+{
+public:
+    ExactKmerCounter()
+        : _k(0)
+        , _canonical(false)
+        , _shards(shard_count)
+    { }
+
+    ExactKmerCounter(int k, bool canonical=true)
+        : _k(k)
+        , _canonical(canonical)
+        , _shards(shard_count)
+    {
+        _check_k(k, K, max_k, "counter");
+    }
+
+    ExactKmerCounter(const string &filename)
+        : _k(0)
+        , _canonical(false)
+    {
+        this->load(filename);
+    }
+
+    inline void consume(boost::string_view sequence)
+    {
+        _scratch.assign(sequence.data(), sequence.size());
+        this->consume(_scratch);
+    }
+
+    inline void consume(const char *sequence, size_t len)
+    {
+        this->consume(boost::string_view(sequence, len));
+    }
+
+    inline void consume(const PackedSeq &sequence)
+    {
+        this->hash_batches(sequence, [this](const uint64_t *hashes, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                _shards[shard_of(hashes[i])].add(hashes[i]);
+            }
+        });
+    }
+
+    void consume(const vector<string> &sequences)
+    {
+        for (const auto &seq: sequences) this->consume(seq);
+    }
+
+    /*! \brief Counts the k-mers of every read in a sequence file
+     *
+     *  With nthreads > 1, each thread hashes k-mers into per-shard buffers of
+     *  batch_size hashes, and inserts a full buffer into its shard under that
+     *  shard's lock.
+     *
+     * \return The number of reads
+     */
+    size_t consume_from(const string &filename, int nthreads=1)
+    {
+        kmseq::KSeqReader seqs(filename);
+        if (nthreads <= 1) {
+            size_t n = 0;
+            for (kmseq::KSeqSpan seq; seqs.next_read(seq);) {
+                this->consume(seq.seq, seq.seq_len);
+                n++;
+            }
+            return n;
+        }
+        vector<mutex> locks(shard_count);
+        vector<vector<vector<uint64_t>>> pending(nthreads, vector<vector<uint64_t>>(shard_count));
+        auto insert = [&](vector<uint64_t> &hashes, size_t shard) {
+            lock_guard<mutex> lock(locks[shard]);
+            for (auto h: hashes) _shards[shard].add(h);
+            hashes.clear();
+        };
+        const size_t n = read_parallel(seqs, nthreads, read_chunk_size, [&](int thread, const PackedSeq &read) {
+            auto &buffers = pending[thread];
+            this->hash_batches(read, [&](const uint64_t *hashes, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    const size_t shard = shard_of(hashes[i]);
+                    buffers[shard].push_back(hashes[i]);
+                    if (buffers[shard].size() == batch_size) {
+                        insert(buffers[shard], shard);
+                    }
+                }
+            });
+        });
+        for (auto &buffers: pending) {
+            for (size_t shard = 0; shard < shard_count; shard++) {
+                insert(buffers[shard], shard);
+            }
+        }
+        return n;
+    }
+
+    /*! \brief Count of a k-mer, given as a sequence of length k */
+    uint64_t count(boost::string_view kmer) const
+    {
+        if (kmer.size() != _k) {
+            throw invalid_argument("k-mer must be of length k");
+        }
+        static thread_local PackedSeq scratch;
+        KmerIterator it(kmer, scratch, _k, _canonical);
+        return it.finished() ? 0 : this->count_hashed(it.next_hashed());
+    }
+
+    /*! \brief Count of a k-mer, given as its hash */
+    inline uint64_t count_hashed(uint64_t hashed_kmer) const
+    {
+        return _shards[shard_of(hashed_kmer)].get(hashed_kmer);
+    }
+
+    /*! \brief Calls fn(kmer, count) for each distinct k-mer, in no order
+     *
+     *  K-mers are passed 2-bit encoded, as by KmerIterator::next().
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        for (const auto &shard: _shards) {
+            shard.for_each([&](uint64_t key, uint64_t count) {
+                fn(inthash64_inverse(key), count);
+            });
+        }
+    }
+
+    /*! \brief Number of distinct k-mers */
+    size_t size() const
+    {
+        size_t size = 0;
+        for (const auto &shard: _shards) size += shard.size();
+        return size;
+    }
+
+    void clear()
+    {
+        for (auto &shard: _shards) shard.clear();
+    }
+
+    inline int k() const
+    {
+        return _k;
+    }
+
+    inline bool canonical() const
+    {
+        return _canonical;
+    }
+
+    /*! \brief Largest k supported by ExactKmerCounter */
+    static constexpr unsigned int max_k = K > 0 ? K : KmerIterator::max_k;
+
+    void save(const string &filename)
+    {
+        _save_archive(filename, *this);
+    }
+
+    void load(const string &filename)
+    {
+        _load_archive(filename, *this);
+    }
+
+protected:
+    static inline size_t shard_of(uint64_t hashed_kmer)
+    {
+        return hashed_kmer >> (64 - shard_bits);
+    }
+
+    /* Hashes the k-mers of sequence in batches, passing each batch to
+     * sink(hashes, n) */
+    template <typename Sink>
+    void hash_batches(const PackedSeq &sequence, Sink &&sink)
+    {
+        BasicKmerIterator<K> ki(sequence, _k, _canonical);
+        uint64_t hashes[batch_size];
+        while (!ki.finished()) {
+            const size_t n = ki.next_hashed_batch(hashes, batch_size);
+            sink(hashes, n);
+        }
+    }
+
+    static constexpr unsigned int shard_bits = 6;
+    static constexpr size_t shard_count = size_t(1) << shard_bits;
+
+    const unsigned int _k;
+    const bool _canonical;
+    vector<ExactKmerTable> _shards;
+    PackedSeq _scratch;
+
+    // Serialization
+    friend class boost::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */)
+    {
+        ar & const_cast<unsigned int &>(_k);
+        ar & const_cast<bool &>(_canonical);
+        ar & _shards;
+    }
+};
+
+
+/**********************************************************************
+*                       ConcurrentKmerTable                          *
+**********************************************************************/
+
+/*! \class ConcurrentKmerTable
+ *  \brief Lock-free open-addressing table of exact counts of hashed k-mers
+ *
+ *  Each slot is a key word and a count word. Threads claim free slots by
+ *  compare-and-swap on the key, and add to counts with atomic adds.
+ *
+ *  The table grows online, without stopping threads. Once a table is more
+ *  than max_load full, one thread allocates a table twice the size and
+ *  links it as the next table. From then on, every add first helps migrate
+ *  a chunk of migrate_chunk slots, then goes to the next table. Migrating a
+ *  slot seals it: a free slot's key is set to moved_key, and the top bit of
+ *  a count is set, after which its old value is added to the next table. An
+ *  add that finds a sealed slot follows the next link, so no count is lost.
+ *  The migrator of the last chunk makes the next table current. Old tables
+ *  are freed by finish_migration(), which must be called when no thread is
+ *  adding, and before any lookups.
+ *
+ *  Keys 0 and moved_key mark free and sealed slots, so the k-mers with
+ *  those hashes are counted on the side.
+ */
+class ConcurrentKmerTable
+{
+public:
+    ConcurrentKmerTable(size_t capacity = 1024)
+    {
+        size_t size = 16;
+        while (size < capacity) size *= 2;
+        _tables.emplace_back(new Table(size));
+        _current.store(_tables.back().get());
+        _special[0] = _special[1] = 0;
+    }
+
+    /*! \brief Adds n to the count of key. Safe to call from many threads */
+    inline void add(uint64_t key, uint64_t n = 1)
+    {
+        if (key == 0 || key == moved_key) {
+            __atomic_fetch_add(&_special[key != 0], n, __ATOMIC_RELAXED);
+            return;
+        }
+        Table *table = _current.load(memory_order_acquire);
+        while (!this->add_to(*table, key, n)) {
+            table = table->next.load(memory_order_acquire);
+        }
+    }
+
+    /*! \brief Completes any migration, and frees old tables
+     *
+     *  Call once no thread is adding, before get(), size() or for_each().
+     */
+    void finish_migration()
+    {
+        // Migrations may finish out of order, leaving _current behind
+        Table *table = _current.load(memory_order_acquire);
+        while (Table *next = table->next.load(memory_order_acquire)) {
+            while (table->migrated.load(memory_order_acquire) < table->nchunks()) {
+                this->help_migrate(*table);
+            }
+            table = next;
+        }
+        _current.store(table, memory_order_release);
+        if (_tables.size() > 1) {
+            for (auto &owned: _tables) {
+                if (owned.get() == table) owned.swap(_tables.front());
+            }
+            _tables.resize(1);
+        }
+    }
+
+    void clear()
+    {
+        this->finish_migration();
+        Table &table = *_current.load();
+        std::fill(table.keys.begin(), table.keys.end(), 0);
+        std::fill(table.counts.begin(), table.counts.end(), 0);
+        table.used = 0;
+        _special[0] = _special[1] = 0;
+    }
+
+    inline uint64_t get(uint64_t key) const
+    {
+        if (key == 0 || key == moved_key) return _special[key != 0];
+        const Table &table = *_current.load(memory_order_acquire);
+        for (size_t i = key & table.mask, probes = 0; probes <= table.mask;
+                i = (i + 1) & table.mask, probes++) {
+            if (table.keys[i] == key) return table.counts[i];
+            if (table.keys[i] == 0) break;
+        }
+        return 0;
+    }
+
+    /*! \brief Number of distinct keys */
+    size_t size() const
+    {
+        return _current.load(memory_order_acquire)->used.load() +
+                (_special[0] > 0) + (_special[1] > 0);
+    }
+
+    inline size_t capacity() const
+    {
+        return _current.load(memory_order_acquire)->keys.size();
+    }
+
+    /*! \brief Calls fn(key, count) for each key in the table, in no order */
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        if (_special[0] > 0) fn(uint64_t(0), _special[0]);
+        if (_special[1] > 0) fn(uint64_t(moved_key), _special[1]);
+        const Table &table = *_current.load(memory_order_acquire);
+        for (size_t i = 0; i < table.keys.size(); i++) {
+            if (table.keys[i] != 0) fn(table.keys[i], table.counts[i]);
+        }
+    }
+
+    static constexpr uint64_t moved_key = ~UINT64_C(0);
+    static constexpr uint64_t moved_count = UINT64_C(1) << 63;
+    static constexpr double max_load = 0.6;
+    static constexpr size_t migrate_chunk = 4096;
+
+protected:
+    struct Table
+    {
+        Table(size_t size)
+            : keys(size, 0)
+            , counts(size, 0)
+            , mask(size - 1)
+            , used(0)
+            , next(nullptr)
+            , growing(false)
+            , claimed(0)
+            , migrated(0)
+        { }
+
+        inline size_t nchunks() const
+        {
+            return (keys.size() + migrate_chunk - 1) / migrate_chunk;
+        }
+
+        vector<uint64_t> keys;
+        vector<uint64_t> counts;
+        size_t mask;
+        atomic<size_t> used;
+        atomic<Table *> next;
+        atomic<bool> growing;
+        // Chunks claimed by and finished by migrating threads
+        atomic<size_t> claimed;
+        atomic<size_t> migrated;
+    };
+
+    /* Adds n to key's count in table, returning false if the key belongs in
+     * the next table instead */
+    bool add_to(Table &table, uint64_t key, uint64_t n)
+    {
+        if (table.next.load(memory_order_acquire) != nullptr) {
+            this->help_migrate(table);
+            return false;
+        }
+        for (size_t i = key & table.mask, probes = 0; probes <= table.mask;
+                i = (i + 1) & table.mask, probes++) {
+            uint64_t found = __atomic_load_n(&table.keys[i], __ATOMIC_ACQUIRE);
+            if (found == 0) {
+                if (__atomic_compare_exchange_n(&table.keys[i], &found, key, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    found = key;
+                    if (table.used.fetch_add(1, memory_order_relaxed) + 1 >
+                            table.keys.size() * max_load) {
+                        this->grow(table);
+                    }
+                }
+            }
+            if (found == moved_key) return false;
+            if (found != key) continue;
+            const uint64_t old = __atomic_fetch_add(&table.counts[i], n, __ATOMIC_ACQ_REL);
+            // A sealed count has been moved, so this add must go there too
+            return (old & moved_count) == 0;
+        }
+        // Full, so wait for the next table
+        this->grow(table);
+        while (table.next.load(memory_order_acquire) == nullptr) {
+            this_thread::yield();
+        }
+        return false;
+    }
+
+    /* Links a table twice the size as the next table, unless another thread
+     * already is */
+    void grow(Table &table)
+    {
+        if (table.growing.exchange(true)) return;
+        unique_ptr<Table> bigger(new Table(table.keys.size() * 2));
+        Table *next = bigger.get();
+        {
+            lock_guard<mutex> lock(_tables_lock);
+            _tables.push_back(std::move(bigger));
+        }
+        table.next.store(next, memory_order_release);
+    }
+
+    /* Migrates the next unclaimed chunk of table, if any */
+    void help_migrate(Table &table)
+    {
+        const size_t chunk = table.claimed.fetch_add(1, memory_order_relaxed);
+        if (chunk >= table.nchunks()) return;
+        Table *next = table.next.load(memory_order_acquire);
+        const size_t end = min(table.keys.size(), (chunk + 1) * migrate_chunk);
+        for (size_t i = chunk * migrate_chunk; i < end; i++) {
+            uint64_t key = 0;
+            if (__atomic_compare_exchange_n(&table.keys[i], &key, moved_key, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            const uint64_t count = __atomic_fetch_or(&table.counts[i], moved_count,
+                                                     __ATOMIC_ACQ_REL);
+            if (count > 0) {
+                Table *target = next;
+                while (!this->add_to(*target, key, count)) {
+                    target = target->next.load(memory_order_acquire);
+                }
+            }
+        }
+        if (table.migrated.fetch_add(1, memory_order_acq_rel) + 1 == table.nchunks()) {
+            Table *old = &table;
+            _current.compare_exchange_strong(old, next, memory_order_acq_rel);
+        }
+    }
+
+    vector<unique_ptr<Table>> _tables;
+    mutex _tables_lock;
+    atomic<Table *> _current;
+    uint64_t _special[2];
+
+    // Serialization
+    friend class boost::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */)
+    {
+        this->finish_migration();
+        Table &table = *_current.load();
+        ar & table.keys;
+        ar & table.counts;
+        ar & _special[0];
+        ar & _special[1];
+        if (Archive::is_loading::value) {
+            table.mask = table.keys.size() - 1;
+            table.used = table.keys.size() - count(table.keys.begin(), table.keys.end(), 0);
+        }
+    }
+};
+
+
+/**********************************************************************
+*                      ConcurrentKmerCounter                         *
+**********************************************************************/
+
+/*! \class ConcurrentKmerCounter
+ *  \brief Exact k-mer counter, for k up to 32, on a lock-free table
+ *
+ *  As ExactKmerCounter, but all threads of consume_from() add k-mers
+ *  directly into one ConcurrentKmerTable, which grows as they do.
+ *
+ *  If K is non-zero, k-mers are iterated with k fixed at compile time.
+ */
+template <unsigned int K = 0>
+class ConcurrentKmerCounter
+{
+public:
+    ConcurrentKmerCounter()
+        : _k(0)
+        , _canonical(false)
+    { }
+
+    ConcurrentKmerCounter(int k, bool canonical=true, size_t capacity=1024)
+        : _k(k)
+        , _canonical(canonical)
+        , _table(capacity)
+    {
+        _check_k(k, K, max_k, "counter");
+    }
+
+    ConcurrentKmerCounter(const string &filename)
+        : _k(0)
+        , _canonical(false)
+    {
+        this->load(filename);
+    }
+
+    inline void consume(boost::string_view sequence)
+    {
+        _scratch.assign(sequence.data(), sequence.size());
+        this->consume(_scratch);
+    }
+
+    inline void consume(const char *sequence, size_t len)
+    {
+        this->consume(boost::string_view(sequence, len));
+    }
+
+    inline void consume(const PackedSeq &sequence)
+    {
+        this->add_kmers(sequence);
+        _table.finish_migration();
+    }
+
+    void consume(const vector<string> &sequences)
+    {
+        for (const auto &seq: sequences) this->consume(seq);
+    }
+
+    /*! \brief Counts the k-mers of every read in a sequence file
+     *
+     * \return The number of reads
+     */
+    size_t consume_from(const string &filename, int nthreads=1)
+    {
+        kmseq::KSeqReader seqs(filename);
+        const size_t n = read_parallel(seqs, nthreads, read_chunk_size, [this](int, const PackedSeq &read) {
+            this->add_kmers(read);
+        });
+        _table.finish_migration();
+        return n;
+    }
+
+    /*! \brief Count of a k-mer, given as a sequence of length k */
+    uint64_t count(boost::string_view kmer) const
+    {
+        if (kmer.size() != _k) {
+            throw invalid_argument("k-mer must be of length k");
+        }
+        static thread_local PackedSeq scratch;
+        KmerIterator it(kmer, scratch, _k, _canonical);
+        return it.finished() ? 0 : _table.get(it.next_hashed());
+    }
+
+    /*! \brief Count of a k-mer, given as its hash */
+    inline uint64_t count_hashed(uint64_t hashed_kmer) const
+    {
+        return _table.get(hashed_kmer);
+    }
+
+    /*! \brief Calls fn(kmer, count) for each distinct k-mer, in no order
+     *
+     *  K-mers are passed 2-bit encoded, as by KmerIterator::next().
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        _table.for_each([&](uint64_t key, uint64_t count) {
+            fn(inthash64_inverse(key), count);
+        });
+    }
+
+    /*! \brief Number of distinct k-mers */
+    inline size_t size() const
+    {
+        return _table.size();
+    }
+
+    void clear()
+    {
+        _table.clear();
+    }
+
+    inline int k() const
+    {
+        return _k;
+    }
+
+    inline bool canonical() const
+    {
+        return _canonical;
+    }
+
+    /*! \brief Largest k supported by ConcurrentKmerCounter */
+    static constexpr unsigned int max_k = K > 0 ? K : KmerIterator::max_k;
+
+    void save(const string &filename)
+    {
+        _save_archive(filename, *this);
+    }
+
+    void load(const string &filename)
+    {
+        _load_archive(filename, *this);
+    }
+
+protected:
+    /* Adds each k-mer of sequence to the table. Safe to call from many
+     * threads */
+    void add_kmers(const PackedSeq &sequence)
+    {
+        BasicKmerIterator<K> ki(sequence, _k, _canonical);
+        uint64_t hashes[batch_size];
+        while (!ki.finished()) {
+            const size_t n = ki.next_hashed_batch(hashes, batch_size);
+            for (size_t i = 0; i < n; i++) _table.add(hashes[i]);
+        }
+    }
+
+    const unsigned int _k;
+    const bool _canonical;
+    ConcurrentKmerTable _table;
+    PackedSeq _scratch;
+
+    // Serialization
+    friend class boost::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */)
+    {
+        ar & const_cast<unsigned int &>(_k);
+        ar & const_cast<bool &>(_canonical);
+        ar & _table;
+    }
+};
+
+
+/**********************************************************************
+*                        BinnedKmerCounter                           *
+**********************************************************************/
+
+/*! \class BinnedKmerCounter
+ *  \brief Exact k-mer counter, for k up to 32, that counts out of core
+ *
+ *  consume_from() counts in two phases. First, reads are split into
+ *  super-k-mers, runs of consecutive k-mers that share a minimizer (the
+ *  smallest hash of their m-mers), and each super-k-mer is appended to one of
+ *  nbins gzipped bin files picked by its minimizer. Every occurrence of a
+ *  k-mer has the same minimizer, so lands in the same bin. Second, the bins
+ *  are counted independently on nthreads threads, each with one
+ *  ExactKmerTable, which is saved beside the bin. So memory is bounded by a
+ *  bin's distinct k-mers per thread, not all of them.
+ *
+ *  Bins live in a fresh directory under tmpdir (by default, the system's
+ *  temporary directory), which is removed with the counter. Counting more
+ *  files adds to the saved tables.
+ *
+ *  If K is non-zero, k-mers are iterated with k fixed at compile time.
+ */
+template <unsigned int K = 0>
+class BinnedKmerCounter
+{
+public:
+    BinnedKmerCounter(int k, bool canonical=true, size_t nbins=256,
+                      const string &tmpdir="", int minimizer_k=11)
+        : _k(k)
+        , _minimizer_k(min(minimizer_k, k))
+        , _canonical(canonical)
+        , _sizes(nbins, 0)
+    {
+        _check_k(k, K, max_k, "counter");
+        if (minimizer_k < 1) {
+            throw invalid_argument("minimizer_k must be positive");
+        }
+        if (nbins < 1) {
+            throw invalid_argument("nbins must be positive");
+        }
+        namespace fs = boost::filesystem;
+        const fs::path base = tmpdir.empty() ? fs::temp_directory_path() : fs::path(tmpdir);
+        _dir = (base / fs::unique_path("kmkm-bins-%%%%-%%%%-%%%%")).string();
+        fs::create_directories(_dir);
+    }
+
+    BinnedKmerCounter(const BinnedKmerCounter &) = delete;
+    BinnedKmerCounter & operator=(const BinnedKmerCounter &) = delete;
+
+    ~BinnedKmerCounter()
+    {
+        boost::system::error_code err;
+        boost::filesystem::remove_all(_dir, err);
+    }
+
+    /*! \brief Counts the k-mers of every read in a sequence file
+     *
+     * \return The number of reads
+     */
+    size_t consume_from(const string &filename, int nthreads=1)
+    {
+        kmseq::KSeqReader seqs(filename);
+        const size_t n = this->bin_reads(seqs, max(nthreads, 1));
+        this->count_bins(max(nthreads, 1));
+        return n;
+    }
+
+    /*! \brief Calls fn(kmer, count) for each distinct k-mer, in no order
+     *
+     *  K-mers are passed 2-bit encoded, as by KmerIterator::next(). Bins are
+     *  loaded one at a time.
+     */
+    template <typename Fn>
+    void for_each(Fn &&fn) const
+    {
+        for (size_t bin = 0; bin < _sizes.size(); bin++) {
+            if (_sizes[bin] == 0) continue;
+            ExactKmerTable table;
+            this->load_table(bin, table);
+            table.for_each([&](uint64_t key, uint64_t count) {
+                fn(inthash64_inverse(key), count);
+            });
+        }
+    }
+
+    /*! \brief Number of distinct k-mers */
+    size_t size() const
+    {
+        size_t size = 0;
+        for (auto s: _sizes) size += s;
+        return size;
+    }
+
+    inline int k() const
+    {
+        return _k;
+    }
+
+    inline bool canonical() const
+    {
+        return _canonical;
+    }
+
+    inline size_t nbins() const
+    {
+        return _sizes.size();
+    }
+
+    /*! \brief Directory holding the bins */
+    inline const string & directory() const
+    {
+        return _dir;
+    }
+
+    /*! \brief Largest k supported by BinnedKmerCounter */
+    static constexpr unsigned int max_k = K > 0 ? K : KmerIterator::max_k;
+
+    /*! \brief Calls sink(start, length, minimizer) for each super-k-mer of
+     *  sequence
+     *
+     *  The minimizer of a k-mer is the smallest kmer_hash() of its (canonical,
+     *  if counting canonically) m-mers. Each super-k-mer spans the maximal
+     *  run of consecutive valid k-mers with the same minimizer.
+     */
+    template <typename Sink>
+    void super_kmers(const PackedSeq &sequence, Sink &&sink) const
+    {
+        // Each window of k - m + 1 m-mers is one k-mer
+        MinimizerIterator mi(sequence, _minimizer_k, _k - _minimizer_k + 1, _canonical);
+        while (!mi.finished()) {
+            const SuperKmer sk = mi.next();
+            sink(sk.start, sk.length, sk.minimizer);
+        }
+    }
+
+protected:
+    inline string bin_path(size_t bin, const char *ext) const
+    {
+        return _dir + "/bin" + to_string(bin) + ext;
+    }
+
+    void load_table(size_t bin, ExactKmerTable &table) const
+    {
+        ifstream fp(this->bin_path(bin, ".kmx"), ios_base::in | ios_base::binary);
+        boost::archive::binary_iarchive ar(fp);
+        ar >> table;
+    }
+
+    /* Phase one: writes the super-k-mers of every read to their bins. Each
+     * thread buffers bin_buffer_size characters per bin, and appends a full
+     * buffer to the bin under its lock. */
+    size_t bin_reads(kmseq::KSeqReader &seqs, int nthreads)
+    {
+        const size_t nbins = _sizes.size();
+        vector<gzFile> bins(nbins, nullptr);
+        auto close_bins = [&]() {
+            for (auto &fp: bins) {
+                if (fp != nullptr) gzclose(fp);
+                fp = nullptr;
+            }
+        };
+        for (size_t bin = 0; bin < nbins; bin++) {
+            bins[bin] = gzopen(this->bin_path(bin, ".fa.gz").c_str(), "wb1");
+            if (bins[bin] == nullptr) {
+                close_bins();
+                throw runtime_error("Could not open bin file: " + this->bin_path(bin, ".fa.gz"));
+            }
+            gzbuffer(bins[bin], bin_buffer_size);
+        }
+
+        vector<mutex> locks(nbins);
+        vector<vector<string>> pending(nthreads, vector<string>(nbins));
+        auto write = [&](string &buf, size_t bin) {
+            lock_guard<mutex> lock(locks[bin]);
+            if (gzwrite(bins[bin], buf.data(), buf.size()) != int(buf.size())) {
+                throw runtime_error("Could not write bin file: " + this->bin_path(bin, ".fa.gz"));
+            }
+            buf.clear();
+        };
+        size_t n;
+        try {
+            n = read_parallel(seqs, nthreads, read_chunk_size, [&](int thread, const PackedSeq &read) {
+                auto &buffers = pending[thread];
+                this->super_kmers(read, [&](size_t start, size_t len, uint64_t minimizer) {
+                    const size_t bin = minimizer % nbins;
+                    string &buf = buffers[bin];
+                    buf += ">\n";
+                    for (size_t i = start; i < start + len; i++) {
+                        buf += "ACGT"[read.base(i)];
+                    }
+                    buf += '\n';
+                    if (buf.size() >= bin_buffer_size) write(buf, bin);
+                });
+            });
+            for (auto &buffers: pending) {
+                for (size_t bin = 0; bin < nbins; bin++) {
+                    if (!buffers[bin].empty()) write(buffers[bin], bin);
+                }
+            }
+        } catch (...) {
+            close_bins();
+            throw;
+        }
+        close_bins();
+        return n;
+    }
+
+    /* Phase two: counts each bin into its saved table, on nthreads threads */
+    void count_bins(int nthreads)
+    {
+        const ssize_t nbins = _sizes.size();
+        exception_ptr error;
+        // Reads are packed into a per-thread buffer reused across reads
+        vector<PackedSeq> scratch(nthreads);
+        #pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+        for (ssize_t bin = 0; bin < nbins; bin++) {
+            try {
+                PackedSeq &packed = scratch[_thread_num()];
+                ExactKmerTable table;
+                if (_sizes[bin] > 0) this->load_table(bin, table);
+                const string path = this->bin_path(bin, ".fa.gz");
+                {
+                    kmseq::KSeqReader seqs(path);
+                    for (kmseq::KSeqSpan seq; seqs.next_read(seq);) {
+                        BasicKmerIterator<K> ki(boost::string_view(seq.seq, seq.seq_len), packed, _k, _canonical);
+                        while (!ki.finished()) table.add(ki.next_hashed());
+                    }
+                }
+                remove(path.c_str());
+                ofstream fp(this->bin_path(bin, ".kmx"), ios_base::out | ios_base::binary);
+                boost::archive::binary_oarchive ar(fp);
+                ar << table;
+                _sizes[bin] = table.size();
+            } catch (...) {
+                #pragma omp critical(kmkm_count_bins)
+                if (!error) error = current_exception();
+            }
+        }
+        if (error) rethrow_exception(error);
+    }
+
+    /* Characters buffered per bin per thread, and by zlib per bin */
+    static constexpr size_t bin_buffer_size = 1 << 16;
+    const unsigned int _k;
+    const unsigned int _minimizer_k;
+    const bool _canonical;
+    vector<size_t> _sizes;
+    string _dir;
+};
+
+
+} // end namespace kmkm
+
+#endif /* end of include guard: KMEXACT_HH_Q3RZ8V1D */
+
+// vim:set et sw=4 ts=4:
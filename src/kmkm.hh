@@ -12,21 +12,152 @@
 #include <iostream>
 #include <fstream>
 #include <functional>
+#include <cstring>
+#include <stdexcept>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 //#include <boost/multi_array.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/align/aligned_allocator.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/unordered_map.hpp>
+#include <boost/serialization/version.hpp>
 #include "kmseq.hh"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 using namespace std;
 
 namespace kmkm {
 
+/* OpenMP thread number, or 0 when built without OpenMP */
+static inline int _thread_num()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/* Seed shared by all threads' _thread_rand() streams; epoch changes on every
+ * reseed, and is zero while threads use their default seeds */
+struct _ThreadRandSeed
+{
+    atomic<uint64_t> seed{0};
+    atomic<uint64_t> epoch{0};
+
+    static _ThreadRandSeed & get()
+    {
+        static _ThreadRandSeed s;
+        return s;
+    }
+};
+
+/* Fast per-thread pseudo-random numbers (splitmix64), seeded by the address
+ * of each thread's state unless _thread_rand_seed() has been called */
+static inline uint64_t _thread_rand()
+{
+    static thread_local uint64_t state = reinterpret_cast<uintptr_t>(&state);
+    static thread_local uint64_t epoch = 0;
+    _ThreadRandSeed &g = _ThreadRandSeed::get();
+    const uint64_t e = g.epoch.load(memory_order_acquire);
+    if (e != epoch) {
+        epoch = e;
+        state = g.seed.load(memory_order_relaxed) +
+                0x632be59bd9b4e019ULL * uint64_t(_thread_num() + 1);
+    }
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Reseeds _thread_rand() on all threads, which pick the seed up on their
+ * next draw. Each thread's stream depends on the seed and its OpenMP thread
+ * number, so runs are reproducible where work is split deterministically. */
+static inline void _thread_rand_seed(uint64_t seed)
+{
+    _ThreadRandSeed &g = _ThreadRandSeed::get();
+    g.seed.store(seed, memory_order_relaxed);
+    g.epoch.fetch_add(1, memory_order_release);
+}
+
+/* Number of threads in the current OpenMP team, or 1 without OpenMP */
+static inline int _num_threads()
+{
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
+
+/* Checks the k of an iterator or counter (what) against its compile-time k
+ * K, and against max_k unless that is 0 */
+static inline void _check_k(int k, unsigned int K, unsigned int max_k, const char *what)
+{
+    if (K > 0 && k != int(K)) {
+        throw invalid_argument(string("k does not match compile-time k of ") + what);
+    }
+    if (max_k == 0 && k < 1) {
+        throw invalid_argument("k must be positive");
+    }
+    if (max_k > 0 && (k < 1 || unsigned(k) > max_k)) {
+        throw invalid_argument("k must be between 1 and " + to_string(max_k));
+    }
+}
+
+/* Writes a boost::serialization binary archive of obj to filename, gzipped
+ * if filename ends in .gz */
+template <typename T>
+void _save_archive(const string &filename, const T &obj)
+{
+    using namespace boost::iostreams;
+    ofstream fp(filename, ios_base::out | ios_base::binary);
+    filtering_streambuf<output> out;
+    if (boost::algorithm::ends_with(filename, ".gz")) {
+        out.push(gzip_compressor());
+    }
+    out.push(fp);
+    boost::archive::binary_oarchive ar(out);
+    ar << obj;
+}
+
+/* Reads obj back from an archive written by _save_archive() */
+template <typename T>
+void _load_archive(const string &filename, T &obj)
+{
+    using namespace boost::iostreams;
+    ifstream fp(filename, ios_base::in | ios_base::binary);
+    filtering_streambuf<input> in;
+    if (boost::algorithm::ends_with(filename, ".gz")) {
+        in.push(gzip_decompressor());
+    }
+    in.push(fp);
+
+    boost::archive::binary_iarchive ar(in);
+    ar >> obj;
+}
+
 /**
 * @brief: 64 bit integer hash function
 *
@@ -42,14 +173,32 @@ static inline uint64_t inthash64(uint64_t x)
     return x;
 }
 
-static inline uint64_t kmer_revcomp(uint64_t x, int k)
+/*! \brief Inverse of inthash64(), recovering a k-mer from its hash */
+static inline uint64_t inthash64_inverse(uint64_t x)
+{
+    x = x ^ (x >> 31) ^ (x >> 62);
+    x *= UINT64_C(0x319642b2d24d8ec3);
+    x = x ^ (x >> 27) ^ (x >> 54);
+    x *= UINT64_C(0x96de1b173f119089);
+    x = x ^ (x >> 30) ^ (x >> 60);
+    return x;
+}
+
+/* Reverses the order of the 2-bit sections of x */
+static inline uint64_t _reverse_bases(uint64_t x)
 {
-    // Reverse 2-bit sections
     x = (x & 0x3333333333333333) <<  2 | (x & 0xCCCCCCCCCCCCCCCC) >>  2;
     x = (x & 0x0F0F0F0F0F0F0F0F) <<  4 | (x & 0xF0F0F0F0F0F0F0F0) >>  4;
     x = (x & 0x00FF00FF00FF00FF) <<  8 | (x & 0xFF00FF00FF00FF00) >>  8;
     x = (x & 0x0000FFFF0000FFFF) << 16 | (x & 0xFFFF0000FFFF0000) >> 16;
     x = (x & 0x00000000FFFFFFFF) << 32 | (x & 0xFFFFFFFF00000000) >> 32;
+    return x;
+}
+
+static inline uint64_t kmer_revcomp(uint64_t x, int k)
+{
+    // Reverse 2-bit sections
+    x = _reverse_bases(x);
     // Complement
     x = ~x;
     // Shift back within bitmask
@@ -57,7 +206,400 @@ static inline uint64_t kmer_revcomp(uint64_t x, int k)
     return x;
 }
 
-/*! \class KmerIterator
+/*! \brief Hash of a 2-bit encoded k-mer, as used by KmerCounter */
+static inline uint64_t kmer_hash(uint64_t x)
+{
+    return inthash64(x);
+}
+
+/*! \brief Mask covering the low 2k bits of a k-mer word */
+static inline uint64_t kmer_mask(uint64_t, unsigned int k)
+{
+    return k >= 32 ? ~UINT64_C(0) : (UINT64_C(1) << (2*k)) - 1;
+}
+
+/*! \brief Number of direct indices of k-mers, see kmer_direct_index() */
+static inline uint64_t kmer_direct_space(unsigned int k, bool canonical=true)
+{
+    const uint64_t all = UINT64_C(1) << (2*k);
+    if (!canonical) return all;
+    // Even k-mers may be their own reverse complement, one per (k/2)-mer
+    return k % 2 == 1 ? all / 2 : (all + (UINT64_C(1) << k)) / 2;
+}
+
+/*! \brief Index of a 2-bit encoded k-mer among all (canonical) k-mers
+ *
+ *  Without canonical, the k-mer itself. Otherwise, a k-mer and its reverse
+ *  complement share an index, below kmer_direct_space(k), which no other
+ *  k-mer has. For odd k, exactly one of the pair has A or C as its middle
+ *  base; its index is that k-mer, less the middle base's high bit. For even
+ *  k, the middle pair of bases picks one of the pair likewise, except when
+ *  the middle pair is its own reverse complement (AT, CG, GC or TA). Then the
+ *  bases either side of it form a (k-2)-mer, whose index is taken in turn.
+ */
+static inline uint64_t kmer_direct_index(uint64_t kmer, unsigned int k, bool canonical=true)
+{
+    if (!canonical) return kmer;
+    if (k % 2 == 1) {
+        if ((kmer >> k) & 1) kmer = kmer_revcomp(kmer, k);
+        return ((kmer >> (k + 1)) << k) | (kmer & ((UINT64_C(1) << k) - 1));
+    }
+    // Rank of each middle pair among those picked (AA AC AG CA CC GA), or among
+    // the self-complementary pairs (AT CG GC TA)
+    static const uint8_t pair_rank[16] = {0, 1, 2, 0, 3, 4, 1, 0, 5, 2, 0, 0, 3, 0, 0, 0};
+    uint64_t offset = 0;
+    for (; k > 0; k -= 2) {
+        // The middle pair is bases k/2 - 1 and k/2, in bits k-2 to k+1
+        const unsigned int shift = k - 2;
+        const uint64_t outer_mask = (UINT64_C(1) << shift) - 1;
+        uint64_t pair = (kmer >> shift) & 15;
+        const uint64_t pair_rc = (((pair & 3) ^ 3) << 2) | ((pair >> 2) ^ 3);
+        const uint64_t outer_space = UINT64_C(1) << (2 * (k - 2));
+        if (pair != pair_rc) {
+            if (pair > pair_rc) {
+                kmer = kmer_revcomp(kmer, k);
+                pair = pair_rc;
+            }
+            const uint64_t outer = ((kmer >> (shift + 4)) << shift) | (kmer & outer_mask);
+            return offset + pair_rank[pair] * outer_space + outer;
+        }
+        offset += 6 * outer_space + pair_rank[pair] * kmer_direct_space(k - 2);
+        kmer = ((kmer >> (shift + 4)) << shift) | (kmer & outer_mask);
+    }
+    return offset;
+}
+
+
+/*! \class WideKmer
+ *  \brief A 2-bit encoded k-mer spanning N 64-bit words, for k > 32
+ *
+ *  Words are stored least significant first, so that a WideKmer holding a
+ *  k-mer of k <= 32 has the same value in w[0] as the uint64_t encoding.
+ *  Provides just the operators needed to roll k-mers in BasicKmerIterator.
+ */
+template <size_t N>
+struct WideKmer
+{
+    uint64_t w[N];
+
+    WideKmer(uint64_t x = 0)
+    {
+        w[0] = x;
+        for (size_t i = 1; i < N; i++) w[i] = 0;
+    }
+
+    inline WideKmer operator<<(unsigned int s) const
+    {
+        WideKmer r;
+        const size_t ws = s / 64, bs = s % 64;
+        for (size_t i = N; i-- > ws;) {
+            r.w[i] = w[i - ws] << bs;
+            if (bs > 0 && i > ws) r.w[i] |= w[i - ws - 1] >> (64 - bs);
+        }
+        return r;
+    }
+
+    inline WideKmer operator>>(unsigned int s) const
+    {
+        WideKmer r;
+        const size_t ws = s / 64, bs = s % 64;
+        for (size_t i = 0; i + ws < N; i++) {
+            r.w[i] = w[i + ws] >> bs;
+            if (bs > 0 && i + ws + 1 < N) r.w[i] |= w[i + ws + 1] << (64 - bs);
+        }
+        return r;
+    }
+
+    inline WideKmer operator|(const WideKmer &o) const
+    {
+        WideKmer r;
+        for (size_t i = 0; i < N; i++) r.w[i] = w[i] | o.w[i];
+        return r;
+    }
+
+    inline WideKmer operator&(const WideKmer &o) const
+    {
+        WideKmer r;
+        for (size_t i = 0; i < N; i++) r.w[i] = w[i] & o.w[i];
+        return r;
+    }
+
+    inline WideKmer operator~() const
+    {
+        WideKmer r;
+        for (size_t i = 0; i < N; i++) r.w[i] = ~w[i];
+        return r;
+    }
+
+    inline bool operator<(const WideKmer &o) const
+    {
+        for (size_t i = N; i-- > 0;) {
+            if (w[i] != o.w[i]) return w[i] < o.w[i];
+        }
+        return false;
+    }
+
+    inline bool operator==(const WideKmer &o) const
+    {
+        for (size_t i = 0; i < N; i++) {
+            if (w[i] != o.w[i]) return false;
+        }
+        return true;
+    }
+
+    inline bool operator!=(const WideKmer &o) const
+    {
+        return !(*this == o);
+    }
+};
+
+template <size_t N>
+static inline WideKmer<N> kmer_revcomp(const WideKmer<N> &x, int k)
+{
+    WideKmer<N> r;
+    for (size_t i = 0; i < N; i++) {
+        r.w[N - 1 - i] = ~_reverse_bases(x.w[i]);
+    }
+    return r >> (64 * N - 2 * k);
+}
+
+/*! \brief Hash of a wide k-mer, reduced to 64 bits
+ *
+ *  Equal to kmer_hash(uint64_t) for k-mers that fit in the first word.
+ */
+template <size_t N>
+static inline uint64_t kmer_hash(const WideKmer<N> &x)
+{
+    uint64_t high = 0;
+    for (size_t i = 1; i < N; i++) high |= x.w[i];
+    if (high == 0) return kmer_hash(x.w[0]);
+    uint64_t h = x.w[0];
+    for (size_t i = 1; i < N; i++) {
+        h = inthash64(h) ^ x.w[i];
+    }
+    return inthash64(h);
+}
+
+template <size_t N>
+static inline WideKmer<N> kmer_mask(const WideKmer<N> &, unsigned int k)
+{
+    WideKmer<N> r;
+    for (size_t i = 0; i < N; i++) {
+        const unsigned int bits = 2*k > 64*i ? 2*k - 64*i : 0;
+        r.w[i] = bits >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << bits) - 1;
+    }
+    return r;
+}
+
+/*! \brief The narrowest k-mer word holding k-mers of size K */
+template <unsigned int K>
+using kmer_word_t = typename conditional<(K <= 32), uint64_t, WideKmer<(K + 31) / 32>>::type;
+
+/**********************************************************************
+*                         Nucleotide encoding                         *
+**********************************************************************/
+
+/*! \brief Encodes 32 nucleotides into 2-bit codes
+ *
+ *  Nucleotide i is stored in bits 2i..2i+1 of `packed` as A=0, C=1, G=2,
+ *  T=3 (case insensitive). Bit i of `invalid` is set if nucleotide i is not
+ *  one of ACGT, in which case its 2-bit code is meaningless.
+ *
+ *  The code is computed as ((c >> 1) ^ (c >> 2)) & 3 on the upper-cased
+ *  character, which lets the vector paths avoid a lookup table.
+ */
+static inline void encode_block32(const char *seq, uint64_t &packed, uint32_t &invalid);
+
+static inline void _encode_block32_scalar(const char *seq, uint64_t &packed, uint32_t &invalid)
+{
+    packed = 0;
+    invalid = 0;
+    for (int i = 0; i < 32; i++) {
+        const uint8_t c = seq[i] & 0x5f; // Force uppercase
+        packed |= uint64_t(((c >> 1) ^ (c >> 2)) & 3) << (2 * i);
+        invalid |= uint32_t(c != 'A' && c != 'C' && c != 'G' && c != 'T') << i;
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+/* The vector encoders are compiled for their instruction sets whatever the
+ * build targets. Unless the build targets AVX2, encode_block32() picks one at
+ * run time, so portable builds still use them. */
+__attribute__((target("avx2")))
+static inline void _encode_block32_avx2(const char *seq, uint64_t &packed, uint32_t &invalid)
+{
+    const __m256i c = _mm256_and_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seq)),
+            _mm256_set1_epi8(0x5f));
+    const __m256i code = _mm256_and_si256(
+            _mm256_xor_si256(_mm256_srli_epi16(c, 1), _mm256_srli_epi16(c, 2)),
+            _mm256_set1_epi8(3));
+    const __m256i valid = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('A')),
+                            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('C'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('G')),
+                            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('T'))));
+    invalid = ~uint32_t(_mm256_movemask_epi8(valid));
+    // Pairs of codes into nibbles, nibbles into bytes, then gather the low
+    // byte of each 32-bit lane.
+    const __m256i pairs = _mm256_maddubs_epi16(code, _mm256_set1_epi16(0x0401));
+    const __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00100001));
+    const __m256i bytes = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    packed = uint64_t(uint32_t(_mm256_extract_epi32(bytes, 0))) |
+             uint64_t(uint32_t(_mm256_extract_epi32(bytes, 4))) << 32;
+}
+
+__attribute__((target("ssse3")))
+static inline void _encode_block16_ssse3(const char *seq, uint32_t &packed, uint32_t &invalid)
+{
+    const __m128i c = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(seq)),
+            _mm_set1_epi8(0x5f));
+    const __m128i code = _mm_and_si128(
+            _mm_xor_si128(_mm_srli_epi16(c, 1), _mm_srli_epi16(c, 2)),
+            _mm_set1_epi8(3));
+    const __m128i valid = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('A')),
+                         _mm_cmpeq_epi8(c, _mm_set1_epi8('C'))),
+            _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('G')),
+                         _mm_cmpeq_epi8(c, _mm_set1_epi8('T'))));
+    invalid = ~uint32_t(_mm_movemask_epi8(valid)) & 0xffff;
+    const __m128i pairs = _mm_maddubs_epi16(code, _mm_set1_epi16(0x0401));
+    const __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+    const __m128i bytes = _mm_shuffle_epi8(quads, _mm_setr_epi8(
+            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    packed = uint32_t(_mm_cvtsi128_si32(bytes));
+}
+
+__attribute__((target("ssse3")))
+static inline void _encode_block32_ssse3(const char *seq, uint64_t &packed, uint32_t &invalid)
+{
+    uint32_t plo, phi, ilo, ihi;
+    _encode_block16_ssse3(seq, plo, ilo);
+    _encode_block16_ssse3(seq + 16, phi, ihi);
+    packed = uint64_t(plo) | uint64_t(phi) << 32;
+    invalid = ilo | ihi << 16;
+}
+
+/* Best encoder this CPU supports: 2 for AVX2, 1 for SSSE3, else 0 */
+static inline int _encode_level()
+{
+    static const int level = __builtin_cpu_supports("avx2") ? 2 :
+                             __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return level;
+}
+
+static inline void encode_block32(const char *seq, uint64_t &packed, uint32_t &invalid)
+{
+#if defined(__AVX2__)
+    _encode_block32_avx2(seq, packed, invalid);
+#else
+    switch (_encode_level()) {
+        case 2:
+            _encode_block32_avx2(seq, packed, invalid);
+            break;
+        case 1:
+            _encode_block32_ssse3(seq, packed, invalid);
+            break;
+        default:
+            _encode_block32_scalar(seq, packed, invalid);
+            break;
+    }
+#endif
+}
+#else
+static inline void encode_block32(const char *seq, uint64_t &packed, uint32_t &invalid)
+{
+    _encode_block32_scalar(seq, packed, invalid);
+}
+#endif
+
+
+/*! \class PackedSeq
+ *  \brief A DNA sequence encoded as 2-bit codes plus an invalid-base bitmask
+ *
+ *  The whole sequence is encoded in one pass by encode_block32(), so that
+ *  iterators can roll k-mers off the packed words rather than decoding
+ *  characters one at a time. Buffers are reused across calls to assign().
+ */
+class PackedSeq
+{
+public:
+    PackedSeq()
+        : _len(0)
+    {
+    }
+
+    PackedSeq(const char *seq, size_t len)
+    {
+        this->assign(seq, len);
+    }
+
+    void assign(const char *seq, size_t len)
+    {
+        const size_t nfull = len / 32;
+        const size_t rem = len % 32;
+        _len = len;
+        _packed.resize(nfull + (rem > 0));
+        _invalid.assign((len + 63) / 64, 0);
+        uint32_t inv;
+        for (size_t b = 0; b < nfull; b++) {
+            encode_block32(seq + 32 * b, _packed[b], inv);
+            _invalid[b / 2] |= uint64_t(inv) << (32 * (b % 2));
+        }
+        if (rem > 0) {
+            // Pad the final partial block; codes past the end are never read
+            char buf[32];
+            memset(buf, 'A', sizeof(buf));
+            memcpy(buf, seq + 32 * nfull, rem);
+            encode_block32(buf, _packed[nfull], inv);
+            _invalid[nfull / 2] |= uint64_t(inv) << (32 * (nfull % 2));
+        }
+    }
+
+    /*! \brief 2-bit code of nucleotide i */
+    inline uint64_t base(size_t i) const
+    {
+        return (_packed[i / 32] >> (2 * (i % 32))) & 3;
+    }
+
+    /*! \brief True if nucleotide i is not one of ACGT */
+    inline bool invalid(size_t i) const
+    {
+        return (_invalid[i / 64] >> (i % 64)) & 1;
+    }
+
+    /*! \brief Position of the first valid nucleotide at or after i
+     *
+     * \return The position, or size() if there is none
+     */
+    inline size_t next_valid(size_t i) const
+    {
+        while (i < _len) {
+            const uint64_t valid = ~_invalid[i / 64] >> (i % 64);
+            if (valid != 0) {
+                return min(i + __builtin_ctzll(valid), _len);
+            }
+            i = (i / 64 + 1) * 64;
+        }
+        return _len;
+    }
+
+    inline size_t size() const
+    {
+        return _len;
+    }
+
+private:
+    size_t _len;
+    vector<uint64_t> _packed;
+    vector<uint64_t> _invalid;
+};
+
+
+/*! \class BasicKmerIterator
  *  \brief Iterator over the kmers of a DNA Sequence
  *
  *  This ought be used like:
@@ -66,61 +608,83 @@ static inline uint64_t kmer_revcomp(uint64_t x, int k)
  *  while (!i.finished()) {
  *      nt = i.next();
  *  }
+ *
+ *  The sequence is encoded up front into a PackedSeq, and k-mers are rolled
+ *  off the packed buffer. The iterator always holds the next valid k-mer, so
+ *  finished() is exact even if the sequence ends in invalid nucleotides.
+ *  Sequences may be given as any span of characters (a string, or a
+ *  boost::string_view over a parser's buffer), or as an already encoded
+ *  PackedSeq, which is borrowed rather than copied and must outlive the
+ *  iterator.
+ *
+ *  If K is non-zero, k is fixed at compile time and the masks and shifts
+ *  used to roll k-mers are constants. KmerIterator (K = 0) takes k at run
+ *  time.
+ *
+ *  KmerT is the k-mer word: uint64_t holds k <= 32, and WideKmer<N> holds k
+ *  up to 32N.
  */
-class KmerIterator
+template <unsigned int K = 0, typename KmerT = uint64_t>
+class BasicKmerIterator
 {
 public:
-    KmerIterator (const string &sequence, int k, bool canonical=true)
-        : _k(k) , _seq(sequence) , _len(sequence.size()) , _pos(0) , _canonical(canonical)
-        , _last_nthash(0) , _mask((UINT64_C(1) << (2*k)) - 1)
+    BasicKmerIterator (boost::string_view sequence, int k, bool canonical=true)
+        : _k(k) , _own(sequence.data(), sequence.size()) , _seq(_own) , _len(sequence.size())
+        , _pos(0) , _run(0) , _canonical(canonical) , _has_next(false)
+        , _fwd(0) , _rev(0) , _mask(kmer_mask(KmerT(), k))
+        , _rev_shift(2*k - 2)
+    {
+        this->init();
+    }
+
+    BasicKmerIterator (const PackedSeq &sequence, int k, bool canonical=true)
+        : _k(k) , _seq(sequence) , _len(sequence.size())
+        , _pos(0) , _run(0) , _canonical(canonical) , _has_next(false)
+        , _fwd(0) , _rev(0) , _mask(kmer_mask(KmerT(), k))
+        , _rev_shift(2*k - 2)
+    {
+        this->init();
+    }
+
+    /*! \brief Iterates over sequence, packing it into the caller's scratch
+     *
+     *  Avoids allocating a PackedSeq per sequence; scratch must outlive the
+     *  iterator, and is overwritten.
+     */
+    BasicKmerIterator (boost::string_view sequence, PackedSeq &scratch, int k, bool canonical=true)
+        : _k(k) , _seq(scratch) , _len(sequence.size())
+        , _pos(0) , _run(0) , _canonical(canonical) , _has_next(false)
+        , _fwd(0) , _rev(0) , _mask(kmer_mask(KmerT(), k))
+        , _rev_shift(2*k - 2)
     {
+        scratch.assign(sequence.data(), sequence.size());
+        this->init();
     }
 
+    BasicKmerIterator (const BasicKmerIterator &) = delete;
+
+    /*! \brief Largest k representable by KmerT */
+    static constexpr unsigned int max_k = sizeof(KmerT) * 4;
+
 
     /*! \brief Returns the next k-mer in sequence
      *
      *  K-mers are returned as 2-bit encoded nucleotide sequences, such that
      *  AAAA... = 0, and TTTT... = 4^k.
      *
-     * \return 2-bit encoded kmer as uint64_t
+     * \return 2-bit encoded kmer as KmerT
      */
-    inline uint64_t next()
+    inline KmerT next()
     {
-        ssize_t skip = 0;
-        do {
-            if (this->finished()) {
-                /* Prevent an out-of-bounds read */
-                return 0;
-            }
-            if (skip > 0) {
-                skip--;
-            }
-            char nucl = _seq[_pos++] & 0x5f; // Force uppercase
-            uint64_t n = 0; // Numeric nucleotide repr
-            switch (nucl) {
-                case 'A':
-                    n = 0;
-                    break;
-                case 'C':
-                    n = 1;
-                    break;
-                case 'G':
-                    n = 2;
-                    break;
-                case 'T':
-                    n = 3;
-                    break;
-                default:
-                    skip = _k;
-                    break;
-            }
-            _last_nthash = ((_last_nthash << 2) | n) & _mask;
-        } while (skip > 0 || _pos < _k);
-        if (_canonical) {
-            return min(_last_nthash, kmer_revcomp(_last_nthash, _k));
-        } else {
-            return _last_nthash;
+        if (!_has_next) {
+            /* Prevent an out-of-bounds read */
+            return KmerT(0);
         }
+        // The reverse complement is rolled alongside the forward k-mer in
+        // advance(), so the canonical k-mer is just the smaller of the two.
+        const KmerT kmer = _canonical ? min(_fwd, _rev) : _fwd;
+        _has_next = this->advance();
+        return kmer;
     }
 
 
@@ -133,12 +697,26 @@ public:
      */
     uint64_t next_hashed()
     {
-        return inthash64(this->next());
+        return kmer_hash(this->next());
         // std::hash not guranteed to be identical between implementations/runs
         // of program. So use our own.
         //return std::hash<uint64_t>{}(this->next());
     }
 
+    /*! \brief Fills `out` with up to `n` hashed k-mers
+     *
+     * \return The number of hashes written, which is less than n only once
+     *          the iterator is finished
+     */
+    size_t next_hashed_batch(uint64_t *out, size_t n)
+    {
+        size_t i = 0;
+        for (; i < n && _has_next; i++) {
+            out[i] = this->next_hashed();
+        }
+        return i;
+    }
+
     /*! \brief Check if iterator has compeleted iteration
      *
      * \return true when finished
@@ -146,7 +724,7 @@ public:
     inline bool finished()
         
     {
-        return _len < _k || _pos >= _len;
+        return !_has_next;
     }
 
     /*! \brief Resets iterator to start position
@@ -154,7 +732,10 @@ public:
     void rewind()
     {
         _pos = 0;
-        _last_nthash = 0;
+        _run = 0;
+        _fwd = KmerT(0);
+        _rev = KmerT(0);
+        _has_next = this->advance();
     }
 
     /*! @brief Gives the (maximum) number of k-mers
@@ -167,196 +748,2233 @@ public:
      */
     inline size_t size() const
     {
-        return max(ssize_t(_len) - _k + 1, ssize_t(0));
+        return max(ssize_t(_len) - ssize_t(this->k()) + 1, ssize_t(0));
+    }
+
+    inline unsigned int k() const
+    {
+        return K > 0 ? K : _k;
+    }
+
+    /*! \brief Position in the sequence of the k-mer next() will return
+     *
+     *  Only meaningful while the iterator is not finished.
+     */
+    inline size_t position() const
+    {
+        return _pos - this->k();
     }
 
 
 private:
+    void init()
+    {
+        static_assert(K <= max_k, "k is too large for k-mer word");
+        _check_k(_k, K, max_k, "iterator");
+        _has_next = this->advance();
+    }
+
+    /* Rolls the window forward until it holds k valid nucleotides. Invalid
+     * nucleotides reset the window, and runs of them are skipped using the
+     * bitmask. The reverse complement is maintained by shifting the
+     * complemented nucleotide into the high end of _rev. Returns false once
+     * the sequence is exhausted. */
+    inline bool advance()
+    {
+        while (_pos < _len) {
+            if (_seq.invalid(_pos)) {
+                _run = 0;
+                _pos = _seq.next_valid(_pos + 1);
+                continue;
+            }
+            const uint64_t n = _seq.base(_pos++);
+            _fwd = ((_fwd << 2) | n) & this->mask();
+            _rev = (_rev >> 2) | (KmerT(n ^ 3) << this->rev_shift());
+            if (++_run >= this->k()) return true;
+        }
+        return false;
+    }
+
+    inline KmerT mask() const
+    {
+        return K > 0 ? kmer_mask(KmerT(), K) : _mask;
+    }
+
+    inline unsigned int rev_shift() const
+    {
+        return K > 0 ? 2*K - 2 : _rev_shift;
+    }
+
     const unsigned int _k;
-    const string &_seq;
+    PackedSeq _own;
+    const PackedSeq &_seq;
     const size_t _len;
     size_t _pos;
+    size_t _run;
     bool _canonical;
-    uint64_t _last_nthash;
-    uint64_t _mask;
+    bool _has_next;
+    KmerT _fwd;
+    KmerT _rev;
+    KmerT _mask;
+    unsigned int _rev_shift;
 };
 
+typedef BasicKmerIterator<0> KmerIterator;
 
-/**********************************************************************
-*                            KmerCounter                             *
-**********************************************************************/
+/*! \brief Iterator over k-mers of up to 64 nucleotides */
+typedef BasicKmerIterator<0, WideKmer<2>> WideKmerIterator;
 
 
+/*! \brief A minimizer, and the span of sequence whose windows share it */
+struct SuperKmer
+{
+    uint64_t minimizer;
+    size_t start;
+    size_t length;
+};
 
-/*! \class KmerCounter
- *  \brief Counting Bloom Filter-based k-mer counter
+
+/*! \class MinimizerIterator
+ *  \brief Iterator over the super-k-mers of a DNA Sequence
  *
+ *  The minimizer of a window of w consecutive k-mers is the smallest of
+ *  their hashes (as KmerIterator::next_hashed()). A super-k-mer is a maximal
+ *  run of consecutive windows with the same minimizer, and spans from the
+ *  start of the first window to the end of the last, so is at least
+ *  w + k - 1 long. Windows never span invalid nucleotides.
+ *
+ *  Window minima are kept in a monotone deque: hashes only ever enter at
+ *  the back, after dropping every larger hash there, so the front is always
+ *  the minimum of the window. Each k-mer costs O(1) amortised, whatever w.
  */
-template <typename ElType = uint8_t>
-class KmerCounter
+class MinimizerIterator
 {
 public:
-    KmerCounter()
-        : _k(0)
-        , _cbf_tables(0)
-        , _canonical(false)
-    { }
+    MinimizerIterator (boost::string_view sequence, int k, int w, bool canonical=true)
+        : _ki(sequence, k, canonical)
+        , _w(w)
+    {
+        this->init();
+    }
 
-    KmerCounter (int k, size_t vecsize, bool canonical=true, size_t cbf_tables=0)
-        : _k(k)
-        , _cbf_tables(cbf_tables)
-        , _canonical(canonical)
-        , _counts(vecsize, 0)
-        , _cbf((vecsize/2) * _cbf_tables, 0)
+    MinimizerIterator (const PackedSeq &sequence, int k, int w, bool canonical=true)
+        : _ki(sequence, k, canonical)
+        , _w(w)
     {
+        this->init();
     }
 
-    KmerCounter(KmerCounter&& x)
-        : _k(x._k)
+    MinimizerIterator (const MinimizerIterator &) = delete;
+
+    /*! \brief Returns the next super-k-mer in sequence */
+    inline SuperKmer next()
+    {
+        const SuperKmer next = _next;
+        _has_next = this->advance();
+        return next;
+    }
+
+    inline bool finished() const
+    {
+        return !_has_next;
+    }
+
+    inline unsigned int k() const
+    {
+        return _ki.k();
+    }
+
+    inline unsigned int w() const
+    {
+        return _w;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        size_t pos;
+    };
+
+    void init()
+    {
+        if (_w < 1) {
+            throw invalid_argument("w must be positive");
+        }
+        // The deque never holds more than one window
+        _deque.resize(_w);
+        _head = _size = 0;
+        _run = 0;
+        _last = 0;
+        _open = false;
+        _has_next = this->advance();
+    }
+
+    inline Entry & at(size_t i)
+    {
+        return _deque[(_head + i) % _w];
+    }
+
+    /* Ends the open super-k-mer, if any, making it the next one */
+    inline bool close()
+    {
+        if (!_open) return false;
+        _open = false;
+        _next = _current;
+        return true;
+    }
+
+    /* Rolls the window forward until a super-k-mer is complete. Returns
+     * false once the sequence is exhausted. */
+    bool advance()
+    {
+        const size_t k = _ki.k();
+        while (!_ki.finished()) {
+            const size_t pos = _ki.position();
+            // Skipped (invalid) k-mers end the run of windows
+            if (_run > 0 && pos != _last + 1) {
+                _run = 0;
+                _head = _size = 0;
+                if (this->close()) return true;
+            }
+            const uint64_t hash = _ki.next_hashed();
+            _last = pos;
+            _run++;
+            if (_size > 0 && this->at(0).pos + _w <= pos) {
+                _head = (_head + 1) % _w;
+                _size--;
+            }
+            while (_size > 0 && this->at(_size - 1).hash > hash) _size--;
+            this->at(_size++) = Entry{hash, pos};
+            if (_run < _w) continue;
+            const uint64_t minimizer = this->at(0).hash;
+            if (_open && minimizer == _current.minimizer) {
+                _current.length = pos + k - _current.start;
+                continue;
+            }
+            const bool closed = this->close();
+            _current = SuperKmer{minimizer, pos + 1 - _w, _w + k - 1};
+            _open = true;
+            if (closed) return true;
+        }
+        return this->close();
+    }
+
+    KmerIterator _ki;
+    const unsigned int _w;
+    vector<Entry> _deque;
+    size_t _head;
+    size_t _size;
+    size_t _run;
+    size_t _last;
+    bool _open;
+    bool _has_next;
+    SuperKmer _current;
+    SuperKmer _next;
+};
+
+
+/*! \class NtHashIterator
+ *  \brief Iterator over the rolling ntHash values of a DNA Sequence
+ *
+ *  Produces the same sequence of k-mer positions as KmerIterator, but
+ *  yields an ntHash (Mohamadi et al. 2016) directly rather than encoding and
+ *  then hashing each k-mer. Each position costs O(1) regardless of k, and k
+ *  is not limited by the width of a machine word.
+ *
+ *  The canonical hash is the smaller of the forward and reverse-complement
+ *  hashes. Note these values differ from KmerIterator::next_hashed().
+ */
+class NtHashIterator
+{
+public:
+    NtHashIterator (boost::string_view sequence, int k, bool canonical=true)
+        : _k(k) , _own(sequence.data(), sequence.size()) , _seq(_own) , _len(sequence.size())
+        , _pos(0) , _run(0) , _canonical(canonical) , _has_next(false)
+        , _fwd(0) , _rev(0)
+    {
+        this->init();
+    }
+
+    NtHashIterator (const PackedSeq &sequence, int k, bool canonical=true)
+        : _k(k) , _seq(sequence) , _len(sequence.size())
+        , _pos(0) , _run(0) , _canonical(canonical) , _has_next(false)
+        , _fwd(0) , _rev(0)
+    {
+        this->init();
+    }
+
+    NtHashIterator (const NtHashIterator &) = delete;
+
+    /*! \brief Returns the ntHash of the next k-mer in sequence
+     *
+     * \return Canonical (or forward) ntHash as uint64_t
+     */
+    inline uint64_t next_hashed()
+    {
+        if (!_has_next) {
+            return 0;
+        }
+        const uint64_t hash = _canonical ? min(_fwd, _rev) : _fwd;
+        _has_next = this->advance();
+        return hash;
+    }
+
+    /*! \brief As KmerIterator::next_hashed_batch() */
+    size_t next_hashed_batch(uint64_t *out, size_t n)
+    {
+        size_t i = 0;
+        for (; i < n && _has_next; i++) {
+            out[i] = this->next_hashed();
+        }
+        return i;
+    }
+
+    inline bool finished() const
+    {
+        return !_has_next;
+    }
+
+    void rewind()
+    {
+        _pos = 0;
+        _run = 0;
+        _fwd = 0;
+        _rev = 0;
+        _has_next = this->advance();
+    }
+
+    /*! @brief Gives the (maximum) number of k-mers, as KmerIterator::size()
+     */
+    inline size_t size() const
+    {
+        return max(ssize_t(_len) - ssize_t(_k) + 1, ssize_t(0));
+    }
+
+private:
+    void init()
+    {
+        _check_k(_k, 0, 0, "iterator");
+        // Per-nucleotide seeds, for A, C, G, T
+        const uint64_t seeds[4] = {
+            UINT64_C(0x3c8bfbb395c60474), UINT64_C(0x3193c18562a02b4c),
+            UINT64_C(0x20323ed082572324), UINT64_C(0x295549f54be24456),
+        };
+        for (unsigned int n = 0; n < 4; n++) {
+            _fwd_in[n] = seeds[n];
+            _fwd_out[n] = rol(seeds[n], _k);
+            _rev_out[n] = ror(seeds[n ^ 3], 1);
+            _rev_in[n] = rol(seeds[n ^ 3], _k - 1);
+        }
+        _has_next = this->advance();
+    }
+
+    static inline uint64_t rol(uint64_t x, unsigned int r)
+    {
+        r %= 64;
+        return r == 0 ? x : (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t ror(uint64_t x, unsigned int r)
+    {
+        r %= 64;
+        return r == 0 ? x : (x >> r) | (x << (64 - r));
+    }
+
+    /* As KmerIterator::advance(). While fewer than k valid nucleotides are
+     * in the window, the hashes are built up from scratch; after that, the
+     * nucleotide leaving the window is rolled out. */
+    inline bool advance()
+    {
+        while (_pos < _len) {
+            if (_seq.invalid(_pos)) {
+                _run = 0;
+                _fwd = _rev = 0;
+                _pos = _seq.next_valid(_pos + 1);
+                continue;
+            }
+            const uint64_t n = _seq.base(_pos++);
+            if (_run < _k) {
+                _fwd = rol(_fwd, 1) ^ _fwd_in[n];
+                _rev ^= rol(_fwd_in[n ^ 3], _run);
+                if (++_run < _k) continue;
+                return true;
+            }
+            const uint64_t out = _seq.base(_pos - 1 - _k);
+            _fwd = rol(_fwd, 1) ^ _fwd_out[out] ^ _fwd_in[n];
+            _rev = ror(_rev, 1) ^ _rev_out[out] ^ _rev_in[n];
+            return true;
+        }
+        return false;
+    }
+
+    const unsigned int _k;
+    PackedSeq _own;
+    const PackedSeq &_seq;
+    const size_t _len;
+    size_t _pos;
+    size_t _run;
+    bool _canonical;
+    bool _has_next;
+    uint64_t _fwd;
+    uint64_t _rev;
+    uint64_t _fwd_in[4];
+    uint64_t _fwd_out[4];
+    uint64_t _rev_out[4];
+    uint64_t _rev_in[4];
+};
+
+
+/*! \class DirectIndexIterator
+ *  \brief Iterator over the direct indices of the k-mers of a DNA Sequence
+ *
+ *  Produces the same sequence of k-mer positions as KmerIterator, but
+ *  yields kmer_direct_index() of each k-mer rather than its hash.
+ */
+class DirectIndexIterator
+{
+public:
+    DirectIndexIterator (boost::string_view sequence, int k, bool canonical=true)
+        : _ki(sequence, k, false) , _k(k) , _canonical(canonical)
+    {
+    }
+
+    DirectIndexIterator (const PackedSeq &sequence, int k, bool canonical=true)
+        : _ki(sequence, k, false) , _k(k) , _canonical(canonical)
+    {
+    }
+
+    /*! \brief Returns the direct index of the next k-mer in sequence */
+    inline uint64_t next_hashed()
+    {
+        return kmer_direct_index(_ki.next(), _k, _canonical);
+    }
+
+    /*! \brief As KmerIterator::next_hashed_batch() */
+    size_t next_hashed_batch(uint64_t *out, size_t n)
+    {
+        size_t i = 0;
+        for (; i < n && !_ki.finished(); i++) {
+            out[i] = this->next_hashed();
+        }
+        return i;
+    }
+
+    inline bool finished()
+    {
+        return _ki.finished();
+    }
+
+private:
+    KmerIterator _ki;
+    const unsigned int _k;
+    const bool _canonical;
+};
+
+
+/*! \brief Hash functions used to map k-mers to KmerCounter buckets
+ *
+ *  HASH_INTHASH encodes each k-mer and hashes it with kmer_hash(), and is
+ *  the default. HASH_NTHASH uses NtHashIterator's rolling hash.
+ *  HASH_DIRECT gives each k-mer its own bucket, its kmer_direct_index(), so
+ *  counts are exact (bar saturation). It needs small k, as the count vector
+ *  grows to one bucket per possible k-mer.
+ */
+enum HashMode {
+    HASH_INTHASH = 0,
+    HASH_NTHASH = 1,
+    HASH_DIRECT = 2,
+};
+
+
+/**********************************************************************
+*                            KmerCounter                             *
+**********************************************************************/
+
+/*! \brief Strategies KmerCounter::count_batch() uses to update counts
+ *
+ *  ENGINE_DIRECT increments each k-mer's bucket in place.
+ *  ENGINE_PARTITIONED buffers bucket indices by the cache-sized slice of the
+ *  count vector they fall in, and increments one slice at a time. This
+ *  trades a sequential write per k-mer for a random DRAM access, which pays
+ *  off when the count vector is much larger than the last level cache.
+ */
+enum CountEngine {
+    ENGINE_DIRECT = 0,
+    ENGINE_PARTITIONED = 1,
+};
+
+/*! \brief How the rows of KmerCounter's count-min sketch are laid out
+ *
+ *  SKETCH_ROWS keeps each row in its own array, so an update touches one
+ *  random cache line per row. SKETCH_BLOCKED splits the sketch into 64-byte
+ *  blocks, and keeps all of a k-mer's counters in one block selected by its
+ *  hash, at different slots picked by a second hash. This costs one cache
+ *  miss per k-mer, at the price of somewhat more collisions.
+ */
+enum SketchLayout {
+    SKETCH_ROWS = 0,
+    SKETCH_BLOCKED = 1,
+};
+
+/*! \brief How KmerCounter stores the count of each bucket
+ *
+ *  COUNTER_LINEAR stores each count in one ElType. COUNTER_PACKED4 packs two
+ *  saturating 4-bit counts into each byte, the even bucket in the low
+ *  nibble, which halves the memory of the count vector. Counts past 15 go to
+ *  the overflow table (see KmerCounter::set_overflow()). COUNTER_LOG stores
+ *  an 8-bit log-scale (Morris) counter, see LogCounterTables.
+ */
+enum CounterMode {
+    COUNTER_LINEAR = 0,
+    COUNTER_PACKED4 = 1,
+    COUNTER_LOG = 2,
+};
+
+/*! \brief How KmerCounter::consume_from() counts on multiple threads
+ *
+ *  PARALLEL_ATOMIC has all threads increment the one count vector with
+ *  atomic operations. PARALLEL_SHARDED gives each thread a private copy of
+ *  the count vector, summed once all reads are counted. Sharding costs a
+ *  count vector of memory per thread, but avoids threads contending for
+ *  the cache lines of very abundant k-mers. PARALLEL_RANGE gives each thread a
+ *  disjoint range of buckets; threads send the bucket indices they hash to
+ *  the owning thread through SpscBatchQueues, so every bucket is written by
+ *  one thread without atomics or a merge.
+ */
+enum ParallelMode {
+    PARALLEL_ATOMIC = 0,
+    PARALLEL_SHARDED = 1,
+    PARALLEL_RANGE = 2,
+};
+
+
+/* Number of hashes the counters generate and count at a time */
+static constexpr size_t batch_size = 256;
+/* Number of reads each counting thread takes from the reader at a time */
+static constexpr size_t read_chunk_size = 1024;
+
+
+/*! \class SpscBatchQueue
+ *  \brief Lock-free single-producer single-consumer queue of index batches
+ *
+ *  A fixed ring of slots, each holding up to batch_size indices. try_push()
+ *  may only be called by one thread and drain() by one other thread.
+ */
+class SpscBatchQueue
+{
+public:
+    SpscBatchQueue(size_t capacity)
+        : _slots(capacity)
+        , _head(0)
+        , _tail(0)
+    {
+    }
+
+    /*! \brief Copies n <= batch_size indices into the queue
+     *
+     * \return false, without copying, if the queue is full
+     */
+    bool try_push(const uint64_t *idx, size_t n)
+    {
+        const size_t tail = _tail.load(memory_order_relaxed);
+        if (tail - _head.load(memory_order_acquire) == _slots.size()) {
+            return false;
+        }
+        Slot &slot = _slots[tail % _slots.size()];
+        slot.n = n;
+        memcpy(slot.idx, idx, n * sizeof(*idx));
+        _tail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+    /*! \brief Calls fn(indices, n) on each queued batch, then frees them
+     *
+     * \return The number of batches drained
+     */
+    template <typename Fn>
+    size_t drain(Fn &&fn)
+    {
+        size_t head = _head.load(memory_order_relaxed);
+        const size_t tail = _tail.load(memory_order_acquire);
+        const size_t n = tail - head;
+        for (; head != tail; head++) {
+            const Slot &slot = _slots[head % _slots.size()];
+            fn(slot.idx, slot.n);
+        }
+        _head.store(head, memory_order_release);
+        return n;
+    }
+
+private:
+    struct Slot
+    {
+        size_t n;
+        uint64_t idx[batch_size];
+    };
+
+    vector<Slot> _slots;
+    // Keep the consumer's and producer's counters on separate cache lines
+    atomic<size_t> _head;
+    char _pad[64];
+    atomic<size_t> _tail;
+};
+
+/*! \brief Runs worker(thread, read) over every read of seqs in parallel
+ *
+ *  nthreads OpenMP threads share the reader, taking reads in chunks of
+ *  chunk_size. Each read is passed to the worker as a PackedSeq, with the
+ *  OpenMP thread number. The first exception thrown by a worker stops all
+ *  threads reading, and is rethrown.
+ *
+ * \return The number of reads
+ */
+template <typename Worker>
+size_t read_parallel(kmseq::KSeqReader &seqs, int nthreads, size_t chunk_size, Worker worker)
+{
+    size_t n = 0;
+    exception_ptr error;
+    #pragma omp parallel num_threads(nthreads) reduction(+:n)
+    {
+        const int thread = _thread_num();
+        vector<kmseq::KSeq> chunk;
+        PackedSeq packed;
+        try {
+            while (true) {
+                size_t nread;
+                #pragma omp critical(kmkm_read_parallel)
+                nread = error ? 0 : seqs.next_chunk(chunk, chunk_size);
+                if (nread == 0) break;
+                for (const auto &read: chunk) {
+                    packed.assign(read.seq.data(), read.seq.size());
+                    worker(thread, packed);
+                }
+                n += nread;
+            }
+        } catch (...) {
+            #pragma omp critical(kmkm_read_parallel)
+            if (!error) error = current_exception();
+        }
+    }
+    if (error) rethrow_exception(error);
+    return n;
+}
+
+/*! \brief Adds src into dst elementwise, saturating at the maximum of T */
+template <typename T>
+static inline void saturating_add(T *dst, const T *src, size_t n)
+{
+    const T maxval = numeric_limits<T>::max();
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        const T sum = dst[i] + src[i];
+        dst[i] = sum < dst[i] ? maxval : sum;
+    }
+}
+
+
+/*! \brief As saturating_add(), on two 4-bit counts packed in each byte */
+template <typename T>
+static inline void saturating_add_packed4(T *dst, const T *src, size_t n)
+{
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        const T lo = (dst[i] & 0xf) + (src[i] & 0xf);
+        const T hi = (dst[i] >> 4) + (src[i] >> 4);
+        dst[i] = (lo > 0xf ? 0xf : lo) | (hi > 0xf ? 0xf : hi) << 4;
+    }
+}
+
+/*! \class LogCounterTables
+ *  \brief Levels of 8-bit log-scale (Morris) counters
+ *
+ *  Levels up to linear_limit count exactly. Above it, a counter steps from
+ *  level v to v + 1 with probability base^-(v - linear_limit), so that level
+ *  v estimates linear_limit + (base^(v - linear_limit) - 1) / (base - 1)
+ *  increments, about 2.2 million at level 255. Estimates above the linear
+ *  levels have a relative standard error of about 16%.
+ */
+struct LogCounterTables
+{
+    static constexpr unsigned int linear_limit = 16;
+    static constexpr double base = 1.05;
+
+    /* Step from level v if a uniform 64-bit draw is at most threshold[v].
+     * Level 255 is the last, so callers must not step from it. */
+    uint64_t threshold[256];
+    /* Count estimated by each level */
+    double value[256];
+
+    LogCounterTables()
+    {
+        for (unsigned int v = 0; v < 256; v++) {
+            if (v < linear_limit) {
+                threshold[v] = numeric_limits<uint64_t>::max();
+                value[v] = v;
+                continue;
+            }
+            const double p = pow(base, -double(v - linear_limit));
+            threshold[v] = p < 1 ? uint64_t(ldexp(p, 64)) : numeric_limits<uint64_t>::max();
+            value[v] = linear_limit + (pow(base, double(v - linear_limit)) - 1) / (base - 1);
+        }
+        threshold[255] = 0;
+    }
+
+    static const LogCounterTables & get()
+    {
+        static const LogCounterTables tables;
+        return tables;
+    }
+
+    /* Level for an estimated count, rounded randomly between the two
+     * nearest levels so that the estimate stays unbiased */
+    uint8_t encode(double count, uint64_t rand) const
+    {
+        if (count >= value[255]) return 255;
+        const unsigned int v = upper_bound(value, value + 256, count) - value - 1;
+        const double frac = (count - value[v]) / (value[v + 1] - value[v]);
+        return v + (ldexp(double(rand), -64) < frac);
+    }
+};
+
+/*! \class BottomKSketch
+ *  \brief Bottom-k MinHash sketch of hashed k-mers, with abundances
+ *
+ *  Keeps the capacity() smallest distinct hashes added, and how often each
+ *  was added. Added hashes are first buffered, and the buffer is sorted and
+ *  merged into the sketch once full, or on flush(). Once the sketch is full,
+ *  hashes above its largest are dropped without buffering. A hash in the
+ *  sketch can never have been dropped, so its abundance is exact.
+ */
+class BottomKSketch
+{
+public:
+    BottomKSketch(size_t capacity = 0)
+        : _capacity(capacity)
+        , _threshold(numeric_limits<uint64_t>::max())
+    { }
+
+    inline void add(uint64_t hash)
+    {
+        if (hash > _threshold) return;
+        _pending.push_back(hash);
+        if (_pending.size() >= max(_capacity, size_t(min_pending))) this->flush();
+    }
+
+    void add(const uint64_t *hashes, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) this->add(hashes[i]);
+    }
+
+    /*! \brief Merges buffered hashes into the sketch */
+    void flush()
+    {
+        if (_pending.empty()) return;
+        sort(_pending.begin(), _pending.end());
+        vector<uint64_t> hashes, counts;
+        hashes.reserve(_capacity);
+        counts.reserve(_capacity);
+        size_t i = 0, j = 0;
+        while (hashes.size() < _capacity && (i < _hashes.size() || j < _pending.size())) {
+            uint64_t hash, count = 0;
+            if (j == _pending.size() || (i < _hashes.size() && _hashes[i] <= _pending[j])) {
+                hash = _hashes[i];
+                count = _counts[i++];
+            } else {
+                hash = _pending[j];
+            }
+            while (j < _pending.size() && _pending[j] == hash) {
+                count++;
+                j++;
+            }
+            hashes.push_back(hash);
+            counts.push_back(count);
+        }
+        _hashes.swap(hashes);
+        _counts.swap(counts);
+        _pending.clear();
+        this->update_threshold();
+    }
+
+    /*! \brief Adds the hashes of another sketch */
+    void merge(const BottomKSketch &other)
+    {
+        if (other._capacity != _capacity) {
+            throw invalid_argument("Can't merge sketches of different sizes");
+        }
+        if (!other._pending.empty()) {
+            BottomKSketch flushed(other);
+            flushed.flush();
+            this->merge(flushed);
+            return;
+        }
+        this->flush();
+        vector<uint64_t> hashes, counts;
+        size_t i = 0, j = 0;
+        while (hashes.size() < _capacity && (i < _hashes.size() || j < other._hashes.size())) {
+            if (j == other._hashes.size() ||
+                    (i < _hashes.size() && _hashes[i] < other._hashes[j])) {
+                hashes.push_back(_hashes[i]);
+                counts.push_back(_counts[i++]);
+            } else if (i == _hashes.size() || other._hashes[j] < _hashes[i]) {
+                hashes.push_back(other._hashes[j]);
+                counts.push_back(other._counts[j++]);
+            } else {
+                hashes.push_back(_hashes[i]);
+                counts.push_back(_counts[i++] + other._counts[j++]);
+            }
+        }
+        _hashes.swap(hashes);
+        _counts.swap(counts);
+        this->update_threshold();
+    }
+
+    /*! \brief Estimated Jaccard similarity of the k-mer sets of two sketches
+     *
+     *  The fraction of the capacity() smallest hashes of both sketches that
+     *  are in each. Both must be flushed.
+     */
+    double jaccard(const BottomKSketch &other) const
+    {
+        size_t i = 0, j = 0, both = 0, seen = 0;
+        while (seen < _capacity && i < _hashes.size() && j < other._hashes.size()) {
+            if (_hashes[i] < other._hashes[j]) {
+                i++;
+            } else if (other._hashes[j] < _hashes[i]) {
+                j++;
+            } else {
+                both++;
+                i++;
+                j++;
+            }
+            seen++;
+        }
+        // Hashes left in either sketch are in it alone
+        seen = min(_capacity, seen + (_hashes.size() - i) + (other._hashes.size() - j));
+        return seen > 0 ? double(both) / double(seen) : 0;
+    }
+
+    void clear()
+    {
+        _hashes.clear();
+        _counts.clear();
+        _pending.clear();
+        _threshold = numeric_limits<uint64_t>::max();
+    }
+
+    /*! \brief Sketched hashes in increasing order. Call flush() first */
+    inline const vector<uint64_t> & hashes() const
+    {
+        return _hashes;
+    }
+
+    /*! \brief Abundance of each of hashes() */
+    inline const vector<uint64_t> & counts() const
+    {
+        return _counts;
+    }
+
+    /*! \brief Most hashes kept, the k of bottom-k */
+    inline size_t capacity() const
+    {
+        return _capacity;
+    }
+
+    /* Fewest hashes buffered before a merge */
+    static constexpr size_t min_pending = 1024;
+
+protected:
+    inline void update_threshold()
+    {
+        const bool full = _capacity > 0 && _hashes.size() == _capacity;
+        _threshold = full ? _hashes.back() : numeric_limits<uint64_t>::max();
+    }
+
+    size_t _capacity;
+    uint64_t _threshold;
+    vector<uint64_t> _hashes;
+    vector<uint64_t> _counts;
+    vector<uint64_t> _pending;
+
+    // Serialization
+    friend class boost::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */)
+    {
+        this->flush();
+        ar & _capacity;
+        ar & _hashes;
+        ar & _counts;
+        this->update_threshold();
+    }
+};
+
+/*! \class HyperLogLog
+ *  \brief HyperLogLog estimator of the number of distinct k-mers
+ *
+ *  Each of 2^precision registers keeps the longest run of leading zeros seen
+ *  in the hashes the top bits of which select it (Flajolet et al. 2007). The
+ *  estimate has a relative standard error of about 1.04 / sqrt(2^precision),
+ *  0.8% at the default precision of 14, from 16 KiB of registers. Small
+ *  counts are estimated by linear counting of empty registers instead.
+ */
+class HyperLogLog
+{
+public:
+    HyperLogLog(unsigned int precision = 14)
+        : _precision(precision)
+    {
+        if (precision < 4 || precision > 24) {
+            throw invalid_argument("HyperLogLog precision must be between 4 and 24");
+        }
+        _registers.assign(size_t(1) << precision, 0);
+    }
+
+    inline void add(uint64_t hash)
+    {
+        const size_t reg = hash >> (64 - _precision);
+        const uint64_t rest = hash << _precision;
+        const uint8_t rank = rest == 0 ? 64 - _precision + 1 : __builtin_clzll(rest) + 1;
+        _registers[reg] = max(_registers[reg], rank);
+    }
+
+    void add(const uint64_t *hashes, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) this->add(hashes[i]);
+    }
+
+    /*! \brief Adds the hashed k-mers of a sequence, as KmerIterator::next_hashed() */
+    void consume(const PackedSeq &sequence, int k, bool canonical=true)
+    {
+        if (k > int(KmerIterator::max_k)) {
+            this->consume_with<WideKmerIterator>(sequence, k, canonical);
+        } else {
+            this->consume_with<KmerIterator>(sequence, k, canonical);
+        }
+    }
+
+    /*! \brief Adds the k-mers of the reads in a sequence file
+     *
+     * \return The number of reads
+     */
+    size_t consume_from(const string &filename, int k, bool canonical=true, int nthreads=1)
+    {
+        kmseq::KSeqReader seqs(filename);
+        if (nthreads <= 1) {
+            size_t n = 0;
+            PackedSeq packed;
+            for (kmseq::KSeqSpan seq; seqs.next_read(seq); n++) {
+                packed.assign(seq.seq, seq.seq_len);
+                this->consume(packed, k, canonical);
+            }
+            return n;
+        }
+        vector<HyperLogLog> shards(nthreads, HyperLogLog(_precision));
+        const size_t n = read_parallel(seqs, nthreads, read_chunk_size, [&](int thread, const PackedSeq &read) {
+            shards[thread].consume(read, k, canonical);
+        });
+        for (const auto &shard: shards) this->merge(shard);
+        return n;
+    }
+
+    /*! \brief Adds the k-mers of the first max_reads reads of a sequence file
+     *
+     *  For a quick estimate of a large file's k-mers: divide estimate() by
+     *  the returned fraction to extrapolate it to the whole file.
+     *
+     * \return The fraction of the file read, by (compressed) size, or 1 if
+     *          it has no more than max_reads reads
+     */
+    double consume_prefix(const string &filename, int k, bool canonical, size_t max_reads)
+    {
+        kmseq::KSeqReader seqs(filename);
+        PackedSeq packed;
+        kmseq::KSeqSpan seq;
+        for (size_t n = 0; n < max_reads; n++) {
+            if (!seqs.next_read(seq)) return 1;
+            packed.assign(seq.seq, seq.seq_len);
+            this->consume(packed, k, canonical);
+        }
+        if (!seqs.next_read(seq)) return 1;
+        const double size = boost::filesystem::file_size(filename);
+        return size > 0 ? min(double(seqs.offset()) / size, 1.0) : 1.0;
+    }
+
+    /*! \brief Adds the hashes of another HyperLogLog of the same precision */
+    void merge(const HyperLogLog &other)
+    {
+        if (other._precision != _precision) {
+            throw invalid_argument("Can't merge HyperLogLogs of different precision");
+        }
+        for (size_t i = 0; i < _registers.size(); i++) {
+            _registers[i] = max(_registers[i], other._registers[i]);
+        }
+    }
+
+    /*! \brief Estimated number of distinct hashes added */
+    double estimate() const
+    {
+        const double m = _registers.size();
+        double sum = 0;
+        size_t zeros = 0;
+        for (auto r: _registers) {
+            sum += ldexp(1.0, -int(r));
+            zeros += r == 0;
+        }
+        const double alpha = 0.7213 / (1 + 1.079 / m);
+        const double raw = alpha * m * m / sum;
+        if (raw <= 2.5 * m && zeros > 0) {
+            return m * log(m / double(zeros));
+        }
+        return raw;
+    }
+
+    void clear()
+    {
+        std::fill(_registers.begin(), _registers.end(), 0);
+    }
+
+    inline unsigned int precision() const
+    {
+        return _precision;
+    }
+
+protected:
+    template <typename Iterator>
+    void consume_with(const PackedSeq &sequence, int k, bool canonical)
+    {
+        Iterator ki(sequence, k, canonical);
+        uint64_t hashes[batch_size];
+        while (!ki.finished()) {
+            const size_t n = ki.next_hashed_batch(hashes, batch_size);
+            this->add(hashes, n);
+        }
+    }
+
+    unsigned int _precision;
+    vector<uint8_t> _registers;
+};
+
+/*! \class KmerCounter
+ *  \brief Counting Bloom Filter-based k-mer counter
+ *
+ *  With cbf_tables > 0, k-mers are instead counted in a count-min sketch of
+ *  cbf_tables rows of cbf_width counters, read with query(). The sketch
+ *  takes the place of the count vector: its counters are the buckets seen
+ *  by data(), buckets() and export_counts(), and counts() is empty.
+ *  Rows are indexed by double hashing, and updated conservatively: only the
+ *  rows holding the current minimum are incremented.
+ *  The rows can instead be interleaved in cache-line blocks, see
+ *  set_sketch_layout().
+ *
+ *  Counts saturate at the maximum of ElType rather than wrapping. With
+ *  set_overflow(true), increments of a saturated bucket are instead counted
+ *  exactly in a small overflow table, see bucket_count(). Counts can also be
+ *  packed two to a byte, or kept on a log scale, see set_counter_mode().
+ *
+ *  If K is non-zero, k-mers are always iterated with k fixed at compile
+ *  time. Otherwise consume() dispatches the common k values (15, 21, 25, 31)
+ *  to compile-time iterators, and uses the run-time KmerIterator for others.
+ *  K-mers longer than 32 (up to 64) are iterated as WideKmer<2>, and hashed
+ *  down to 64 bits by kmer_hash().
+ */
+template <typename ElType = uint8_t, unsigned int K = 0>
+class KmerCounter
+{
+public:
+    KmerCounter()
+        : _k(0)
+        , _cbf_tables(0)
+        , _cbf_width(0)
+        , _canonical(false)
+        , _hash_mode(HASH_INTHASH)
+        , _prefetch_distance(default_prefetch_distance)
+        , _engine(ENGINE_DIRECT)
+        , _sketch_layout(SKETCH_ROWS)
+        , _counter_mode(COUNTER_LINEAR)
+        , _parallel_mode(PARALLEL_ATOMIC)
+        , _partition_bits(0)
+        , _overflow_enabled(false)
+        , _scale(1)
+        , _has_staged(false)
+    { }
+
+    /*! \param cbf_width Counters per count-min row, by default
+     *                   vecsize / cbf_tables, so that the sketch holds
+     *                   vecsize counters
+     */
+    KmerCounter (int k, size_t vecsize, bool canonical=true, size_t cbf_tables=0,
+                 size_t cbf_width=0)
+        : _k(k)
+        , _cbf_tables(cbf_tables)
+        , _cbf_width(cbf_width > 0 || cbf_tables == 0 ? cbf_width : vecsize / cbf_tables)
+        , _canonical(canonical)
+        , _hash_mode(HASH_INTHASH)
+        , _prefetch_distance(default_prefetch_distance)
+        , _engine(ENGINE_DIRECT)
+        , _sketch_layout(SKETCH_ROWS)
+        , _counter_mode(COUNTER_LINEAR)
+        , _parallel_mode(PARALLEL_ATOMIC)
+        , _partition_bits(0)
+        , _overflow_enabled(false)
+        , _scale(1)
+        , _counts(cbf_tables > 0 ? 0 : vecsize, 0)
+        , _cbf(_cbf_width * _cbf_tables, 0)
+        , _has_staged(false)
+    {
+        // Larger k are checked when consuming, as HASH_NTHASH supports any k
+        _check_k(k, K, 0, "counter");
+        if (_cbf_tables > 0 && _cbf_width == 0) {
+            throw invalid_argument("Count-min rows must have at least one counter");
+        }
+    }
+
+    KmerCounter(KmerCounter&& x)
+        : _k(x._k)
         , _cbf_tables(x._cbf_tables)
+        , _cbf_width(x._cbf_width)
         , _canonical(x._canonical)
+        , _hash_mode(x._hash_mode)
+        , _prefetch_distance(x._prefetch_distance)
+        , _engine(x._engine)
+        , _sketch_layout(x._sketch_layout)
+        , _counter_mode(x._counter_mode)
+        , _parallel_mode(x._parallel_mode)
+        , _partition_bits(x._partition_bits)
+        , _overflow_enabled(x._overflow_enabled)
+        , _scale(x._scale)
+        , _sketch(std::move(x._sketch))
         , _counts(std::move(x._counts))
         , _cbf(std::move(x._cbf))
+        , _overflow(std::move(x._overflow))
+        , _staged(std::move(x._staged))
+        , _staged_n(std::move(x._staged_n))
+        , _has_staged(x._has_staged)
     { }
 
-    KmerCounter(const string &filename)
-        : _k(0)
-        , _cbf_tables(0)
-        , _canonical(false)
+    KmerCounter(const string &filename)
+        : _k(0)
+        , _cbf_tables(0)
+        , _cbf_width(0)
+        , _canonical(false)
+        , _hash_mode(HASH_INTHASH)
+        , _prefetch_distance(default_prefetch_distance)
+        , _engine(ENGINE_DIRECT)
+        , _sketch_layout(SKETCH_ROWS)
+        , _counter_mode(COUNTER_LINEAR)
+        , _parallel_mode(PARALLEL_ATOMIC)
+        , _partition_bits(0)
+        , _overflow_enabled(false)
+        , _scale(1)
+        , _has_staged(false)
+    {
+        this->load(filename);
+    }
+
+    inline KmerCounter & operator=(KmerCounter&& x)
+    {
+        if (this != &x) {
+            _k = x._k;
+            _cbf_tables = x._cbf_tables;
+            _cbf_width = x._cbf_width;
+            _canonical = x._canonical;
+            _hash_mode = x._hash_mode;
+            _prefetch_distance = x._prefetch_distance;
+            _engine = x._engine;
+            _sketch_layout = x._sketch_layout;
+            _counter_mode = x._counter_mode;
+            _parallel_mode = x._parallel_mode;
+            _partition_bits = x._partition_bits;
+            _overflow_enabled = x._overflow_enabled;
+            _scale = x._scale;
+            _sketch = std::move(x._sketch);
+            _counts = std::move(x._counts);
+            _cbf = std::move(x._cbf);
+            _overflow = std::move(x._overflow);
+            _staged = std::move(x._staged);
+            _staged_n = std::move(x._staged_n);
+            _has_staged = x._has_staged;
+        }
+        return *this;
+    }
+
+    inline void count(uint64_t hashed_kmer)
+    {
+        if (this->buckets() == 0) {
+            throw "CBF not initialised";
+        }
+        if (_cbf_tables > 0) {
+            this->sketch_increment(_cbf.data(), hashed_kmer);
+        } else {
+            this->increment(hashed_kmer % this->buckets());
+        }
+    }
+
+    /*! \brief Estimated count of a hashed k-mer
+     *
+     *  The count-min estimate if the counter has CBF tables, which never
+     *  underestimates. Otherwise the count of the k-mer's bucket, saturated
+     *  at the maximum of ElType (see bucket_count()).
+     */
+    inline ElType query(uint64_t hashed_kmer) const
+    {
+        if (this->buckets() == 0) {
+            throw "CBF not initialised";
+        }
+        this->apply_staged();
+        if (_cbf_tables == 0) {
+            const uint64_t maxval = numeric_limits<ElType>::max();
+            return ElType(min(this->bucket_value(hashed_kmer % this->buckets()), maxval));
+        }
+        ElType current = numeric_limits<ElType>::max();
+        this->for_each_sketch_index(hashed_kmer, [&](size_t i) {
+            current = min(current, _cbf[i]);
+        });
+        return current;
+    }
+
+    /*! \brief Counts `n` hashed k-mers, as if by calling count() on each
+     *
+     *  How the counts are updated depends on the engine (see CountEngine).
+     *  With ENGINE_PARTITIONED, counts are staged, and reach the count vector
+     *  once their partition's buffer fills, or before counts are next read,
+     *  merged or saved.
+     */
+    void count_batch(const uint64_t *hashes, size_t n)
+    {
+        if (this->buckets() == 0) {
+            throw "CBF not initialised";
+        }
+        if (_cbf_tables > 0) {
+            for (size_t i = 0; i < n; i++) {
+                this->count(hashes[i]);
+            }
+            return;
+        }
+        switch (_engine) {
+            case ENGINE_PARTITIONED:
+                this->count_partitioned(hashes, n);
+                break;
+            default:
+                this->count_direct(hashes, n);
+                break;
+        }
+    }
+
+    /*! \brief Selects how count_batch() updates the count vector
+     *
+     *  Any staged counts are flushed first. Staged counts are applied before
+     *  counts are read, merged or saved, so the engine only affects speed,
+     *  not the resulting counts (beyond the random draws of COUNTER_LOG).
+     *  It is not saved with the counts.
+     */
+    void set_engine(CountEngine engine)
+    {
+        this->flush();
+        _engine = engine;
+        _staged.clear();
+        _staged.shrink_to_fit();
+        _staged_n.clear();
+        if (_engine == ENGINE_PARTITIONED) {
+            // Partitions are power-of-two sized, so that the partition of a
+            // bucket is a shift away, and hold at most partition_bytes.
+            _partition_bits = 0;
+            while ((sizeof(ElType) << (_partition_bits + 1)) <= partition_bytes) {
+                _partition_bits++;
+            }
+            const size_t npart = (this->buckets() >> _partition_bits) + 1;
+            _staged.resize(npart * staging_size);
+            _staged_n.assign(npart, 0);
+        }
+    }
+
+    inline CountEngine engine() const
+    {
+        return _engine;
+    }
+
+    /*! \brief Selects the layout of the count-min sketch (see SketchLayout)
+     *
+     *  This clears the sketch, so should be set before counting. The layout
+     *  is saved with the counts. With SKETCH_BLOCKED, the number of CBF
+     *  tables can be at most the number of counters in a 64-byte block.
+     */
+    void set_sketch_layout(SketchLayout layout)
+    {
+        if (layout == SKETCH_BLOCKED && _cbf_tables > block_slots) {
+            throw invalid_argument("Blocked sketches can have at most " +
+                                   to_string(block_slots) + " CBF tables");
+        }
+        _sketch_layout = layout;
+        size_t size = _cbf_width * _cbf_tables;
+        if (_sketch_layout == SKETCH_BLOCKED) {
+            // Round up to whole blocks
+            size = (size + block_slots - 1) / block_slots * block_slots;
+        }
+        _cbf.assign(size, 0);
+    }
+
+    inline SketchLayout sketch_layout() const
+    {
+        return _sketch_layout;
+    }
+
+    /*! \brief Selects how bucket counts are stored (see CounterMode)
+     *
+     *  This clears the counts, so should be set before counting. The number
+     *  of buckets is kept, rounded up to even for COUNTER_PACKED4, which also
+     *  enables the overflow table; leaving COUNTER_PACKED4 disables it again.
+     *  COUNTER_LOG never overflows. The mode is saved with the counts.
+     */
+    void set_counter_mode(CounterMode mode)
+    {
+        if (mode != COUNTER_LINEAR && (sizeof(ElType) != 1 || _cbf_tables > 0)) {
+            throw invalid_argument("Packed and log counters need 8-bit elements and no CBF tables");
+        }
+        const size_t size = this->buckets();
+        if (_counter_mode == COUNTER_PACKED4) _overflow_enabled = false;
+        _counter_mode = mode;
+        _counts.assign(mode == COUNTER_PACKED4 ? (size + 1) / 2 : size, 0);
+        if (mode == COUNTER_PACKED4) _overflow_enabled = true;
+        this->clear();
+        this->set_engine(_engine);
+    }
+
+    inline CounterMode counter_mode() const
+    {
+        return _counter_mode;
+    }
+
+    /*! \brief Applies any counts staged by the engine to the count vector,
+     *  and any hashes buffered by the bottom-k sketch to the sketch
+     *
+     *  Reading counts, merging and saving apply staged counts first, so this
+     *  is only needed before reading sketch().
+     */
+    void flush()
+    {
+        this->apply_staged();
+        _sketch.flush();
+    }
+
+    /*! \brief Sets how many k-mers ahead count_batch() prefetches buckets
+     *
+     *  Prefetching pays off once the count vector is much larger than the
+     *  last level cache. A distance of 0 disables it. Distances beyond the
+     *  batch size (256) have no further effect.
+     */
+    void set_prefetch_distance(size_t distance)
+    {
+        _prefetch_distance = distance;
+    }
+
+    inline size_t prefetch_distance() const
+    {
+        return _prefetch_distance;
+    }
+
+    /*! \brief Counts the k-mers of a sequence held in any buffer
+     *
+     *  The sequence is encoded into a buffer owned by the counter, so no
+     *  per-sequence allocation happens once it has grown to the read length.
+     */
+    inline void consume(boost::string_view sequence)
+    {
+        _scratch.assign(sequence.data(), sequence.size());
+        this->consume(_scratch);
+    }
+
+    inline void consume(const char *sequence, size_t len)
+    {
+        this->consume(boost::string_view(sequence, len));
+    }
+
+    inline void consume(const PackedSeq &sequence)
+    {
+        this->hash_batches(sequence, [this](const uint64_t *hashes, size_t n) {
+            this->count_batch(hashes, n);
+        });
+    }
+
+    void consume(const vector<string> &sequences)
+    {
+        for (const auto &seq: sequences) this->consume(seq);
+        this->flush();
+    }
+
+    void clear()
+    {
+        std::fill(_counts.begin(), _counts.end(), 0);
+        std::fill(_cbf.begin(), _cbf.end(), 0);
+        std::fill(_staged_n.begin(), _staged_n.end(), 0);
+        _has_staged = false;
+        _overflow.clear();
+        _sketch.clear();
+    }
+
+    /*! \brief The count vector as stored, see set_counter_mode()
+     *
+     *  Use export_counts() for one count per bucket in any counter mode.
+     *  Empty for counters with CBF tables, whose buckets are the sketch's.
+     */
+    inline const vector<ElType>& counts() const
+    {
+        this->apply_staged();
+        return _counts;
+    }
+
+    /*! \brief Number of buckets in the count vector */
+    inline size_t buckets() const
+    {
+        if (_cbf_tables > 0) return _cbf.size();
+        return _counter_mode == COUNTER_PACKED4 ? _counts.size() * 2 : _counts.size();
+    }
+
+    /*! \brief Count of each bucket, including any overflow
+     *
+     *  Counts saturate at the maximum of T, which should be at least as wide
+     *  as ElType.
+     */
+    template <typename T = ElType>
+    vector<T> export_counts() const
     {
-        this->load(filename);
+        vector<T> out(this->buckets());
+        const ElType *counts = this->data();
+        T *dst = out.data();
+        if (_counter_mode == COUNTER_PACKED4) {
+            #pragma omp simd
+            for (size_t i = 0; i < _counts.size(); i++) {
+                dst[2 * i] = counts[i] & 0xf;
+                dst[2 * i + 1] = counts[i] >> 4;
+            }
+        } else if (_counter_mode == COUNTER_LOG) {
+            const double *value = LogCounterTables::get().value;
+            const double maxval = numeric_limits<T>::max();
+            for (size_t i = 0; i < _counts.size(); i++) {
+                dst[i] = T(min(round(value[counts[i]]), maxval));
+            }
+        } else {
+            #pragma omp simd
+            for (size_t i = 0; i < out.size(); i++) {
+                dst[i] = counts[i];
+            }
+        }
+        const uint64_t maxval = numeric_limits<T>::max();
+        for (const auto &it: _overflow) {
+            out[it.first] = T(min(uint64_t(out[it.first]) + it.second, maxval));
+        }
+        return out;
     }
 
-    inline KmerCounter & operator=(KmerCounter&& x)
+    /*! \brief The buckets as stored: the count vector, or the sketch of
+     *  counters with CBF tables
+     */
+    inline const ElType * data() const
     {
-        if (this != &x) {
-            _k = x._k;
-            _cbf_tables = x._cbf_tables;
-            _canonical = x._canonical;
-            _counts = std::move(x._counts);
-            _cbf = std::move(x._cbf);
+        this->apply_staged();
+        return _cbf_tables > 0 ? _cbf.data() : _counts.data();
+    }
+
+    inline size_t nnz() const
+    {
+        const ElType *counts = this->data();
+        size_t nnz = 0;
+        if (_counter_mode == COUNTER_PACKED4) {
+            #pragma omp simd reduction(+:nnz)
+            for (size_t i = 0; i < _counts.size(); i++) {
+                nnz += ((counts[i] & 0xf) != 0) + ((counts[i] >> 4) != 0);
+            }
+            return nnz;
+        }
+        const size_t size = this->buckets();
+        #pragma omp simd reduction(+:nnz)
+        for (size_t i = 0; i < size; i++) {
+            nnz += counts[i] != 0;
+        }
+        return nnz;
+    }
+
+    /*! \brief Enables exact counting past the maximum of ElType
+     *
+     *  Once enabled, increments of saturated buckets are counted in an
+     *  overflow table keyed by bucket. This does not apply to the count-min
+     *  estimates of counters with CBF tables. The setting and table are saved
+     *  with the counts.
+     */
+    void set_overflow(bool enabled)
+    {
+        _overflow_enabled = enabled;
+    }
+
+    inline bool overflow_enabled() const
+    {
+        return _overflow_enabled;
+    }
+
+    /*! \brief Increments past saturation of each saturated bucket */
+    inline const unordered_map<uint64_t, uint64_t> & overflow() const
+    {
+        return _overflow;
+    }
+
+    /*! \brief Count of a bucket, including any overflow
+     *
+     *  With COUNTER_LOG, the rounded estimate of the bucket's count.
+     */
+    inline uint64_t bucket_count(size_t bucket) const
+    {
+        this->apply_staged();
+        uint64_t count = this->bucket_value(bucket);
+        const auto it = _overflow.find(bucket);
+        if (it != _overflow.end()) count += it->second;
+        return count;
+    }
+
+    /*! \brief Fraction of buckets holding a count
+     *
+     *  A measure of how often distinct k-mers share buckets, see
+     *  buckets_for().
+     */
+    inline double collision_rate() const
+    {
+        if (this->buckets() == 0) return -1;
+        return double(this->nnz()) / double(this->buckets());
+    }
+
+    /*! \brief Number of buckets that distinct_kmers distinct k-mers are
+     *  expected to fill to the given collision_rate()
+     *
+     *  Hashing n k-mers into m buckets leaves a fraction exp(-n / m) of them
+     *  empty, so m = -n / ln(1 - rate). Estimate n with a HyperLogLog.
+     */
+    static size_t buckets_for(uint64_t distinct_kmers, double collision_rate)
+    {
+        if (!(collision_rate > 0 && collision_rate < 1)) {
+            throw invalid_argument("Collision rate must be between 0 and 1");
         }
+        const double buckets = -double(distinct_kmers) / log1p(-collision_rate);
+        return max(size_t(ceil(buckets)), size_t(1));
     }
 
-    inline void count(uint64_t hashed_kmer)
+    inline int k() const
+    {
+        return _k;
+    }
+
+    /*! \brief Selects the hash function used to map k-mers to buckets
+     *
+     *  Counts made with different hash modes are not comparable, so this
+     *  should be set before counting. The mode is saved with the counts.
+     *  HASH_DIRECT needs k <= max_direct_k and no CBF tables. It resizes the
+     *  count vector to kmer_direct_space() buckets, and clears it. Only
+     *  HASH_NTHASH supports k > max_k.
+     */
+    void set_hash_mode(HashMode mode)
+    {
+        if (mode != HASH_NTHASH && _k > max_k) {
+            throw invalid_argument("k > " + to_string(max_k) + " needs HASH_NTHASH");
+        }
+        if (mode == HASH_DIRECT) {
+            if (_scale > 1 || _sketch.capacity() > 0) {
+                throw invalid_argument("Direct indexing can't be scaled or sketched");
+            }
+            if (_k > max_direct_k || _cbf_tables > 0) {
+                throw invalid_argument("Direct indexing needs k <= " + to_string(max_direct_k) +
+                                       " and no CBF tables");
+            }
+            const size_t size = kmer_direct_space(_k, _canonical);
+            _counts.assign(_counter_mode == COUNTER_PACKED4 ? (size + 1) / 2 : size, 0);
+            this->clear();
+            this->set_engine(_engine);
+        }
+        _hash_mode = mode;
+    }
+
+    inline HashMode hash_mode() const
+    {
+        return _hash_mode;
+    }
+
+    /*! \brief Counts only k-mers whose hash is below 2^64 / scale
+     *
+     *  This is FracMinHash subsampling: roughly one in scale k-mers is kept,
+     *  always the same ones, so abundances and containment estimated from
+     *  the kept k-mers are unbiased. The count vector can be about scale
+     *  times smaller. Other k-mers are dropped as they are hashed, before
+     *  touching the count vector. Hashes given to count() or count_batch()
+     *  are counted as given. A scale of 1 keeps every k-mer. Not supported
+     *  with HASH_DIRECT. The scale is saved with the counts.
+     */
+    void set_scale(uint64_t scale)
+    {
+        if (scale > 1 && _hash_mode == HASH_DIRECT) {
+            throw invalid_argument("Direct indexing can't be scaled");
+        }
+        _scale = max(scale, uint64_t(1));
+    }
+
+    inline uint64_t scale() const
+    {
+        return _scale;
+    }
+
+    /*! \brief Keeps a bottom-k sketch of the k-mers counted, with k = size
+     *
+     *  Every k-mer hashed from a sequence is added to the sketch, whatever
+     *  the scale, on as many threads as are counting. A size of 0 disables
+     *  the sketch. Setting the size clears the sketch. Not supported with
+     *  HASH_DIRECT. The sketch is saved with the counts.
+     */
+    void set_sketch_size(size_t size)
+    {
+        if (size > 0 && _hash_mode == HASH_DIRECT) {
+            throw invalid_argument("Direct indexing can't be sketched");
+        }
+        _sketch = BottomKSketch(size);
+    }
+
+    /*! \brief The bottom-k sketch, see set_sketch_size(). Call flush() first,
+     *  if counting single sequences */
+    inline const BottomKSketch & sketch() const
+    {
+        return _sketch;
+    }
+
+    /*! \brief Largest hash kept, see set_scale() */
+    inline uint64_t max_hash() const
     {
-        const size_t cvidx = hashed_kmer % _counts.size();
-        if (_counts.size() == 0) {
+        return _scale > 1 ? numeric_limits<uint64_t>::max() / _scale : numeric_limits<uint64_t>::max();
+    }
+
+    /*! \brief Largest k supported by KmerCounter, except with HASH_NTHASH */
+    static constexpr unsigned int max_k = K > 0 ? K : WideKmerIterator::max_k;
+
+    /*! \brief Largest k supported by HASH_DIRECT, where the count vector
+     *  holds 4^14 / 2 buckets */
+    static constexpr unsigned int max_direct_k = 14;
+
+    void save(const string &filename)
+    {
+        this->flush();
+        _save_archive(filename, *this);
+    }
+
+    void load(const string &filename)
+    {
+        _load_archive(filename, *this);
+    }
+
+    /*! \brief Counts the k-mers of every read in a sequence file
+     *
+     *  With nthreads > 1, one reader is shared by nthreads OpenMP threads,
+     *  which each take chunks of reads from KSeqReader::next_chunk(). How
+     *  they count is set by set_parallel_mode(); by default they use relaxed
+     *  atomic increments. This ignores the engine. Counters with CBF tables
+     *  need PARALLEL_SHARDED, as concurrent conservative updates could
+     *  undercount. Without OpenMP, the reads are counted on a single thread.
+     *
+     * \return The number of reads
+     */
+    size_t consume_from(const string &filename, int nthreads=1)
+    {
+        kmseq::KSeqReader seqs(filename);
+        size_t n = 0;
+        if (nthreads <= 1) {
+            for (kmseq::KSeqSpan seq; seqs.next_read(seq);) {
+                this->consume(seq.seq, seq.seq_len);
+                n++;
+            }
+            this->flush();
+            return n;
+        }
+        if (_cbf_tables > 0 && _parallel_mode != PARALLEL_SHARDED) {
+            throw invalid_argument("Multithreaded counting with CBF tables needs PARALLEL_SHARDED");
+        }
+        if (this->buckets() == 0) {
             throw "CBF not initialised";
         }
+        this->flush();
+        if (_sketch.capacity() > 0) {
+            _sketch_shards.assign(nthreads, BottomKSketch(_sketch.capacity()));
+        }
+        if (_overflow_enabled) {
+            _overflow_shards.assign(nthreads, unordered_map<uint64_t, uint64_t>());
+        }
+        try {
+            switch (_parallel_mode) {
+                case PARALLEL_SHARDED:
+                    n = this->consume_sharded(seqs, nthreads);
+                    break;
+                case PARALLEL_RANGE:
+                    n = this->consume_ranged(seqs, nthreads);
+                    break;
+                default:
+                    n = read_parallel(seqs, nthreads, read_chunk_size, [this](int, const PackedSeq &read) {
+                        this->hash_batches(read, [this](const uint64_t *hashes, size_t n) {
+                            this->count_atomic(hashes, n);
+                        });
+                    });
+                    break;
+            }
+        } catch (...) {
+            _sketch_shards.clear();
+            this->merge_overflow_shards();
+            throw;
+        }
+        for (const auto &shard: _sketch_shards) _sketch.merge(shard);
+        _sketch_shards.clear();
+        this->merge_overflow_shards();
+        return n;
+    }
+
+    /*! \brief Selects how consume_from() shares counts between threads */
+    void set_parallel_mode(ParallelMode mode)
+    {
+        _parallel_mode = mode;
+    }
 
+    inline ParallelMode parallel_mode() const
+    {
+        return _parallel_mode;
+    }
 
-        ElType current;
-        if (_cbf_tables > 0) {
-            // If using CBF, do a count-min operation to determine current
-            // count.
-            const size_t cbfsize = _counts.size() / 2;
-            const size_t cbfidx = hashed_kmer % cbfsize;
-            current = numeric_limits<ElType>::max();
+    /*! \brief Adds another counter's counts to this one's, saturating at the
+     *  maximum count
+     */
+    void merge(const KmerCounter &other)
+    {
+        if (other._k != _k || other._canonical != _canonical ||
+                other._hash_mode != _hash_mode ||
+                other._scale != _scale ||
+                other._sketch.capacity() != _sketch.capacity() ||
+                other._counter_mode != _counter_mode ||
+                other._counts.size() != _counts.size() ||
+                other._cbf_tables != _cbf_tables ||
+                other._cbf_width != _cbf_width ||
+                other._cbf.size() != _cbf.size()) {
+            throw invalid_argument("Can't merge KmerCounters with different parameters");
+        }
+        this->flush();
+        other.apply_staged();
+        this->add_counts(0, other._counts.data(), _counts.size());
+        saturating_add(_cbf.data(), other._cbf.data(), _cbf.size());
+        _sketch.merge(other._sketch);
+        if (_overflow_enabled) {
+            for (const auto &it: other._overflow) {
+                _overflow[it.first] += it.second;
+            }
+        }
+    }
+
+protected:
+    /* Calls fn with the index of the k-mer's counter in each count-min row.
+     *
+     * SKETCH_ROWS indexes rows by double hashing: row t uses
+     * (hash + t * step) % width, where step is an independent odd hash.
+     * SKETCH_BLOCKED selects a block by the hash, and splits it into one
+     * span per row. Successive digits of step, in base span, pick the slot
+     * within each span. */
+    template <typename Fn>
+    inline void for_each_sketch_index(uint64_t hashed_kmer, Fn &&fn) const
+    {
+        uint64_t step = inthash64(hashed_kmer ^ 0x9e3779b97f4a7c15ULL) | 1;
+        if (_sketch_layout == SKETCH_BLOCKED) {
+            const size_t span = block_slots / _cbf_tables;
+            const size_t block = hashed_kmer % (_cbf.size() / block_slots) * block_slots;
             for (size_t t = 0; t < _cbf_tables; t++) {
-                ElType tval = _cbf[t * cbfsize + cbfidx];
-                if (tval < current) {
-                    current = tval;
-                }
+                fn(block + t * span + step % span);
+                step /= span;
             }
-        } else {
-            // Otherwise, read current count directly from the CV
-            current = _counts[cvidx];
+            return;
+        }
+        for (size_t t = 0; t < _cbf_tables; t++) {
+            fn(t * _cbf_width + (hashed_kmer + t * step) % _cbf_width);
         }
-        _counts[cvidx] = current + 1;
     }
 
-    inline void consume(const string &sequence)
+    /* Conservative update of a count-min sketch laid out like _cbf,
+     * saturating rather than wrapping so that the minimum never drops */
+    inline void sketch_increment(ElType *cbf, uint64_t hashed_kmer)
     {
-        KmerIterator ki(sequence, _k, _canonical);
-        while (!ki.finished()) {
-            this->count(ki.next_hashed());
+        ElType current = numeric_limits<ElType>::max();
+        this->for_each_sketch_index(hashed_kmer, [&](size_t i) {
+            current = min(current, cbf[i]);
+        });
+        if (current == numeric_limits<ElType>::max()) {
+            return;
         }
+        this->for_each_sketch_index(hashed_kmer, [&](size_t i) {
+            if (cbf[i] == current) cbf[i]++;
+        });
     }
 
-    void consume(const vector<string> &sequences)
+    /* Count of a bucket, without overflow */
+    inline uint64_t bucket_value(size_t bucket) const
     {
-        for (auto seq: sequences) this->consume(seq);
+        if (_counter_mode == COUNTER_PACKED4) {
+            return (_counts[bucket >> 1] >> ((bucket & 1) * 4)) & 0xf;
+        }
+        if (_counter_mode == COUNTER_LOG) {
+            return uint64_t(round(LogCounterTables::get().value[_counts[bucket]]));
+        }
+        return this->data()[bucket];
     }
 
-    void clear()
+    /* Saturating increment of a bucket, spilling into the overflow table if
+     * enabled. Safe to call concurrently for buckets in different bytes. */
+    inline void increment(size_t idx)
     {
-        std::fill(_counts.begin(), _counts.end(), 0);
-        std::fill(_cbf.begin(), _cbf.end(), 0);
+        this->increment(_counts.data(), idx);
     }
 
-    inline const vector<ElType>& counts() const
+    /* As increment(), on a count vector laid out like _counts */
+    inline void increment(ElType *counts, size_t idx)
     {
-        return _counts;
+        if (_counter_mode == COUNTER_PACKED4) {
+            ElType &c = counts[idx >> 1];
+            const unsigned int shift = (idx & 1) * 4;
+            if (((c >> shift) & 0xf) != 0xf) {
+                c += ElType(1) << shift;
+            } else if (_overflow_enabled) {
+                this->spill(idx, 1);
+            }
+            return;
+        }
+        if (_counter_mode == COUNTER_LOG) {
+            ElType &c = counts[idx];
+            if (c != 255 && _thread_rand() <= LogCounterTables::get().threshold[c]) c++;
+            return;
+        }
+        ElType &c = counts[idx];
+        if (c != numeric_limits<ElType>::max()) {
+            c++;
+        } else if (_overflow_enabled) {
+            this->spill(idx, 1);
+        }
     }
 
-    inline const ElType * data() const
+    /* Adds n increments of a saturated bucket to the overflow table, or to
+     * the calling thread's shard of it while consume_from() runs */
+    inline void spill(size_t idx, uint64_t n)
     {
-        return _counts.data();
+        if (_overflow_shards.empty()) {
+            _overflow[idx] += n;
+        } else {
+            _overflow_shards[_thread_num()][idx] += n;
+        }
     }
 
-    inline size_t nnz() const
+    /* Moves the per-thread overflow shards into the overflow table */
+    void merge_overflow_shards()
     {
-        size_t nnz = 0;
-        for (auto v: _counts) if (v > 0) nnz++;
-        return nnz;
+        for (const auto &shard: _overflow_shards) {
+            for (const auto &it: shard) _overflow[it.first] += it.second;
+        }
+        _overflow_shards.clear();
     }
 
-    inline double collision_rate() const
+    /* Adds len elements of a count vector laid out like _counts into
+     * _counts from element start on, saturating, and spilling any excess
+     * if overflow is enabled */
+    void add_counts(size_t start, const ElType *src, size_t len)
     {
-        if (_counts.size() == 0) return -1;
-        return double(this->nnz()) / double(_counts.size());
+        if (_counter_mode == COUNTER_PACKED4) {
+            const ElType *dst = _counts.data() + start;
+            for (size_t i = 0; _overflow_enabled && i < len; i++) {
+                if ((src[i] | dst[i]) == 0) continue;
+                for (unsigned int half = 0; half < 2; half++) {
+                    const unsigned int sum = ((dst[i] >> (half * 4)) & 0xf) +
+                                             ((src[i] >> (half * 4)) & 0xf);
+                    if (sum > 0xf) this->spill(2 * (start + i) + half, sum - 0xf);
+                }
+            }
+            saturating_add_packed4(_counts.data() + start, src, len);
+            return;
+        }
+        if (_counter_mode == COUNTER_LOG) {
+            // Levels don't add, so sum their estimates
+            const LogCounterTables &tables = LogCounterTables::get();
+            ElType *dst = _counts.data() + start;
+            for (size_t i = 0; i < len; i++) {
+                if (src[i] == 0) continue;
+                dst[i] = tables.encode(tables.value[dst[i]] + tables.value[src[i]],
+                                       _thread_rand());
+            }
+            return;
+        }
+        if (!_overflow_enabled) {
+            saturating_add(_counts.data() + start, src, len);
+            return;
+        }
+        const uint64_t maxval = numeric_limits<ElType>::max();
+        ElType *dst = _counts.data() + start;
+        for (size_t i = 0; i < len; i++) {
+            const uint64_t sum = uint64_t(dst[i]) + src[i];
+            if (sum > maxval) {
+                dst[i] = ElType(maxval);
+                this->spill(start + i, sum - maxval);
+            } else {
+                dst[i] = ElType(sum);
+            }
+        }
     }
 
-    inline int k() const
+    /* Increments buckets in place. See count_batch() */
+    inline void count_direct(const uint64_t *hashes, size_t n)
     {
-        return _k;
+        const size_t size = this->buckets();
+        const unsigned int shift = _counter_mode == COUNTER_PACKED4 ? 1 : 0;
+        size_t idx[batch_size];
+        for (size_t start = 0; start < n; start += batch_size) {
+            const size_t len = min(n - start, size_t(batch_size));
+            for (size_t i = 0; i < len; i++) {
+                idx[i] = hashes[start + i] % size;
+            }
+            if (_prefetch_distance == 0) {
+                for (size_t i = 0; i < len; i++) {
+                    this->increment(idx[i]);
+                }
+                continue;
+            }
+            const size_t dist = min(_prefetch_distance, len);
+            for (size_t i = 0; i < dist; i++) {
+                __builtin_prefetch(&_counts[idx[i] >> shift], 1);
+            }
+            for (size_t i = 0; i < len; i++) {
+                if (i + dist < len) {
+                    __builtin_prefetch(&_counts[idx[i + dist] >> shift], 1);
+                }
+                this->increment(idx[i]);
+            }
+        }
     }
 
-    void save(const string &filename)
+    /* Stages bucket offsets by partition, and increments a partition's
+     * buckets once its staging buffer fills. All of those increments land in
+     * one cache-sized slice of the count vector. */
+    inline void count_partitioned(const uint64_t *hashes, size_t n)
     {
-        using namespace boost::iostreams;
-        ofstream fp(filename, ios_base::out | ios_base::binary);
-        filtering_streambuf<output> out;
-        if (boost::algorithm::ends_with(filename, ".gz")) {
-            out.push(gzip_compressor());
+        const size_t size = this->buckets();
+        _has_staged = _has_staged || n > 0;
+        const size_t offset_mask = (size_t(1) << _partition_bits) - 1;
+        for (size_t i = 0; i < n; i++) {
+            const size_t idx = hashes[i] % size;
+            const size_t p = idx >> _partition_bits;
+            _staged[p * staging_size + _staged_n[p]] = uint32_t(idx & offset_mask);
+            if (++_staged_n[p] == staging_size) {
+                this->flush_partition(p);
+            }
         }
-        out.push(fp);
-        boost::archive::binary_oarchive ar(out);
-        ar << *this;
     }
 
-    void load(const string &filename)
+    /* Applies staged counts before they are read. Staged counts are
+     * logically part of the count vector, so readers stay const. Not safe
+     * to call concurrently while counts are staged. */
+    inline void apply_staged() const
     {
-        using namespace boost::iostreams;
-        ifstream fp(filename, ios_base::in | ios_base::binary);
-        filtering_streambuf<input> in;
-        if (boost::algorithm::ends_with(filename, ".gz")) {
-            in.push(gzip_decompressor());
+        if (!_has_staged) return;
+        KmerCounter *self = const_cast<KmerCounter *>(this);
+        for (size_t p = 0; p < _staged_n.size(); p++) {
+            self->flush_partition(p);
         }
-        in.push(fp);
+        self->_has_staged = false;
+    }
 
-        boost::archive::binary_iarchive ar(in);
-        ar >> *this;
+    inline void flush_partition(size_t p)
+    {
+        const size_t base = p << _partition_bits;
+        const uint32_t *staged = _staged.data() + p * staging_size;
+        for (size_t i = 0; i < _staged_n[p]; i++) {
+            this->increment(base + staged[i]);
+        }
+        _staged_n[p] = 0;
     }
 
-    size_t consume_from(const string &filename)
+    /* Hashes the k-mers of sequence in batches, passing each batch to
+     * sink(hashes, n). Dispatches to the iterator for the hash mode and k. */
+    template <typename Sink>
+    inline void hash_batches(const PackedSeq &sequence, Sink &&sink)
     {
-        kmseq::KSeqReader seqs(filename);
+        if (_hash_mode == HASH_NTHASH) {
+            this->consume_with<NtHashIterator>(sequence, sink);
+            return;
+        }
+        if (_hash_mode == HASH_DIRECT) {
+            this->consume_with<DirectIndexIterator>(sequence, sink);
+            return;
+        }
+        if (K > 0) {
+            this->consume_with<BasicKmerIterator<K, kmer_word_t<K>>>(sequence, sink);
+            return;
+        }
+        switch (_k) {
+            case 15:
+                this->consume_with<BasicKmerIterator<15>>(sequence, sink);
+                break;
+            case 21:
+                this->consume_with<BasicKmerIterator<21>>(sequence, sink);
+                break;
+            case 25:
+                this->consume_with<BasicKmerIterator<25>>(sequence, sink);
+                break;
+            case 31:
+                this->consume_with<BasicKmerIterator<31>>(sequence, sink);
+                break;
+            default:
+                if (_k > KmerIterator::max_k) {
+                    this->consume_with<WideKmerIterator>(sequence, sink);
+                } else {
+                    this->consume_with<KmerIterator>(sequence, sink);
+                }
+                break;
+        }
+    }
+
+    template <typename Iterator, typename Sink>
+    inline void consume_with(const PackedSeq &sequence, Sink &sink)
+    {
+        Iterator ki(sequence, _k, _canonical);
+        uint64_t hashes[batch_size];
+        const uint64_t max_hash = this->max_hash();
+        BottomKSketch *sketch = nullptr;
+        if (_sketch.capacity() > 0) {
+            sketch = _sketch_shards.empty() ? &_sketch : &_sketch_shards[_thread_num()];
+        }
+        while (!ki.finished()) {
+            size_t n = ki.next_hashed_batch(hashes, batch_size);
+            if (sketch != nullptr) sketch->add(hashes, n);
+            if (_scale > 1) {
+                // Compacts the kept hashes without branching on each
+                size_t kept = 0;
+                for (size_t i = 0; i < n; i++) {
+                    hashes[kept] = hashes[i];
+                    kept += hashes[i] <= max_hash;
+                }
+                n = kept;
+            }
+            if (n > 0) sink(hashes, n);
+        }
+    }
+
+    /* PARALLEL_SHARDED: each thread but the first counts into a private
+     * shard, which are then added into the count vector in parallel. The
+     * first thread counts into the count vector directly. Increments of
+     * saturated shard buckets, and the excess of saturated sums, spill into
+     * the overflow table if enabled. With CBF tables, the shards are
+     * count-min sketches; their sum never underestimates, as each shard's
+     * sketch never underestimates the k-mers it counted. */
+    size_t consume_sharded(kmseq::KSeqReader &seqs, int nthreads)
+    {
+        const bool sketched = _cbf_tables > 0;
+        const size_t size = this->buckets();
+        const size_t storage = sketched ? _cbf.size() : _counts.size();
+        vector<vector<ElType>> shards(nthreads);
+        const size_t n = read_parallel(seqs, nthreads, read_chunk_size, [&](int thread, const PackedSeq &read) {
+            ElType *counts = sketched ? _cbf.data() : _counts.data();
+            if (thread > 0) {
+                // Allocated by the owning thread, for first-touch placement
+                if (shards[thread].empty()) shards[thread].assign(storage, 0);
+                counts = shards[thread].data();
+            }
+            this->hash_batches(read, [&](const uint64_t *hashes, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    if (sketched) {
+                        this->sketch_increment(counts, hashes[i]);
+                    } else {
+                        this->increment(counts, hashes[i] % size);
+                    }
+                }
+            });
+        });
+        const size_t nblocks = (storage + reduce_block_size - 1) / reduce_block_size;
+        #pragma omp parallel for num_threads(nthreads) schedule(static)
+        for (size_t b = 0; b < nblocks; b++) {
+            const size_t start = b * reduce_block_size;
+            const size_t len = min(storage - start, size_t(reduce_block_size));
+            for (const auto &shard: shards) {
+                if (shard.empty()) continue;
+                if (sketched) {
+                    saturating_add(_cbf.data() + start, shard.data() + start, len);
+                } else {
+                    this->add_counts(start, shard.data() + start, len);
+                }
+            }
+        }
+        return n;
+    }
+
+    /* PARALLEL_RANGE: thread t owns buckets [t * range, (t + 1) * range).
+     * Each thread reads and hashes chunks of reads, incrementing buckets it
+     * owns and batching the rest per owner. Full batches are pushed onto
+     * queue (src, dst), and each thread drains its incoming queues between
+     * chunks, and whenever a push finds a queue full. Once every thread has
+     * finished reading and pushed its last batches, a final drain empties
+     * all queues. */
+    size_t consume_ranged(kmseq::KSeqReader &seqs, int nthreads)
+    {
+        typedef SpscBatchQueue Queue;
+        const size_t size = this->buckets();
+        vector<unique_ptr<Queue>> queues;
+        atomic<int> finished(0);
+        size_t range = size;
+        int nteam = 1;
         size_t n = 0;
-        for (kmseq::KSeq seq; seqs.next_read(seq);) {
-            this->consume(seq.seq);
-            n++;
+        exception_ptr error;
+
+        #pragma omp parallel num_threads(nthreads) reduction(+:n)
+        {
+            #pragma omp single
+            {
+                // The team may be smaller than requested
+                nteam = _num_threads();
+                range = (size + nteam - 1) / nteam;
+                // Packed buckets sharing a byte must have the same owner
+                range += range & 1;
+                for (int i = 0; i < nteam * nteam; i++) {
+                    queues.emplace_back(new Queue(ranged_queue_slots));
+                }
+            }
+            const int me = _thread_num();
+            auto drain = [&]() {
+                size_t drained = 0;
+                for (int src = 0; src < nteam; src++) {
+                    drained += queues[src * nteam + me]->drain([this](const uint64_t *idx, size_t n) {
+                        for (size_t i = 0; i < n; i++) this->increment(idx[i]);
+                    });
+                }
+                return drained;
+            };
+            // Waiting threads yield, in case they share a core with the
+            // thread they wait on
+            auto drain_or_yield = [&]() {
+                if (drain() == 0) this_thread::yield();
+            };
+            vector<vector<uint64_t>> outbox(nteam);
+            auto send = [&](int dst) {
+                Queue &queue = *queues[me * nteam + dst];
+                while (!queue.try_push(outbox[dst].data(), outbox[dst].size())) {
+                    drain_or_yield();
+                }
+                outbox[dst].clear();
+            };
+
+            vector<kmseq::KSeq> chunk;
+            PackedSeq packed;
+            try {
+                while (true) {
+                    size_t nread;
+                    #pragma omp critical(kmkm_read_parallel)
+                    nread = error ? 0 : seqs.next_chunk(chunk, read_chunk_size);
+                    if (nread == 0) break;
+                    for (const auto &read: chunk) {
+                        packed.assign(read.seq.data(), read.seq.size());
+                        this->hash_batches(packed, [&](const uint64_t *hashes, size_t n) {
+                            for (size_t i = 0; i < n; i++) {
+                                const size_t idx = hashes[i] % size;
+                                const int owner = idx / range;
+                                if (owner == me) {
+                                    this->increment(idx);
+                                    continue;
+                                }
+                                outbox[owner].push_back(idx);
+                                if (outbox[owner].size() == batch_size) {
+                                    send(owner);
+                                }
+                            }
+                        });
+                    }
+                    n += nread;
+                    drain();
+                }
+            } catch (...) {
+                #pragma omp critical(kmkm_read_parallel)
+                if (!error) error = current_exception();
+            }
+            // Whatever happened, keep draining so no other thread blocks on us
+            for (int dst = 0; dst < nteam; dst++) {
+                if (!outbox[dst].empty()) send(dst);
+            }
+            finished.fetch_add(1, memory_order_release);
+            while (finished.load(memory_order_acquire) < nteam) {
+                drain_or_yield();
+            }
+            drain();
         }
+        if (error) rethrow_exception(error);
         return n;
     }
 
-protected:
-    const unsigned int _k;
-    const size_t _cbf_tables;
-    const bool _canonical;
+    /* As count_direct(), but safe to call from many threads at once */
+    inline void count_atomic(const uint64_t *hashes, size_t n)
+    {
+        const size_t size = this->buckets();
+        const bool packed = _counter_mode == COUNTER_PACKED4;
+        const bool log = _counter_mode == COUNTER_LOG;
+        const uint64_t *threshold = LogCounterTables::get().threshold;
+        for (size_t i = 0; i < n; i++) {
+            const size_t idx = hashes[i] % size;
+            // The count is the bits under mask of the element, shifted
+            const unsigned int shift = packed ? (idx & 1) * 4 : 0;
+            const ElType mask = packed ? ElType(0xf << shift) : numeric_limits<ElType>::max();
+            ElType *c = &_counts[packed ? idx >> 1 : idx];
+            ElType current = __atomic_load_n(c, __ATOMIC_RELAXED);
+            while (true) {
+                if ((current & mask) == mask) {
+                    if (_overflow_enabled && !log) this->spill(idx, 1);
+                    break;
+                }
+                if (log && ((current & 0xff) == 255 || _thread_rand() > threshold[current & 0xff])) {
+                    break;
+                }
+                if (__atomic_compare_exchange_n(c, &current, ElType(current + (ElType(1) << shift)),
+                                                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    /* PARALLEL_SHARDED: number of buckets each thread reduces at a time */
+    static constexpr size_t reduce_block_size = 64 * 1024;
+    /* PARALLEL_RANGE: batches in flight between each pair of threads */
+    static constexpr size_t ranged_queue_slots = 8;
+    /* ENGINE_PARTITIONED: size of each count vector slice, and the number of
+     * bucket offsets staged per slice */
+    static constexpr size_t partition_bytes = 256 * 1024;
+    static constexpr size_t staging_size = 512;
+    static constexpr size_t default_prefetch_distance = 0;
+    /* SKETCH_BLOCKED: counters per cache line */
+    static constexpr size_t block_slots = 64 / sizeof(ElType);
+
+    unsigned int _k;
+    size_t _cbf_tables;
+    size_t _cbf_width;
+    bool _canonical;
+    HashMode _hash_mode;
+    size_t _prefetch_distance;
+    CountEngine _engine;
+    SketchLayout _sketch_layout;
+    CounterMode _counter_mode;
+    ParallelMode _parallel_mode;
+    unsigned int _partition_bits;
+    bool _overflow_enabled;
+    uint64_t _scale;
+    BottomKSketch _sketch;
+    // Per-thread sketches, while consume_from() counts on several threads
+    vector<BottomKSketch> _sketch_shards;
     vector<ElType> _counts;
-    vector<ElType> _cbf;
+    // 64-byte aligned, so that blocks of a blocked sketch are cache lines
+    vector<ElType, boost::alignment::aligned_allocator<ElType, 64>> _cbf;
+    unordered_map<uint64_t, uint64_t> _overflow;
+    // Per-thread overflow tables, while consume_from() counts on several
+    // threads
+    vector<unordered_map<uint64_t, uint64_t>> _overflow_shards;
+    vector<uint32_t> _staged;
+    vector<size_t> _staged_n;
+    // Whether any counts are staged, see apply_staged()
+    bool _has_staged;
+    PackedSeq _scratch;
 
     // Serialization
     friend class boost::serialization::access;
@@ -364,14 +2982,66 @@ protected:
     template <typename Archive>
     void serialize(Archive &ar, const unsigned int version)
     {
-        ar & const_cast<unsigned int &>(_k);
-        ar & const_cast<bool &>(_canonical);
+        ar & _k;
+        ar & _canonical;
         ar & _counts;
+        if (version >= 1) {
+            int hash_mode = _hash_mode;
+            ar & hash_mode;
+            _hash_mode = HashMode(hash_mode);
+        }
+        if (version >= 2) {
+            ar & _cbf_tables;
+            ar & _cbf_width;
+            ar & _cbf;
+            // Older counters kept an unused count vector beside the sketch
+            if (Archive::is_loading::value && _cbf_tables > 0) {
+                vector<ElType>().swap(_counts);
+            }
+        }
+        if (version >= 3) {
+            int layout = _sketch_layout;
+            ar & layout;
+            _sketch_layout = SketchLayout(layout);
+        }
+        if (version >= 4) {
+            ar & _overflow_enabled;
+            ar & _overflow;
+        }
+        if (version >= 5) {
+            int mode = _counter_mode;
+            ar & mode;
+            _counter_mode = CounterMode(mode);
+        }
+        if (version >= 6) {
+            ar & _scale;
+        }
+        if (version >= 7) {
+            ar & _sketch;
+        }
     }
 };
 
 
 } // end namespace kmercount
+
+namespace boost {
+namespace serialization {
+
+// Version 1 adds the hash mode, version 2 the count-min sketch, version 3
+// the sketch layout, version 4 the overflow table, version 5 the counter
+// mode, version 6 the scale, version 7 the bottom-k sketch
+template <typename ElType, unsigned int K>
+struct version<kmkm::KmerCounter<ElType, K>>
+{
+    typedef mpl::int_<7> type;
+    typedef mpl::integral_c_tag tag;
+    BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+
+} // end namespace serialization
+} // end namespace boost
+
 #endif /* end of include guard: KMKM_HH_WY0MH8N1 */
 
 // vim:set et sw=4 ts=4:
@@ -30,6 +30,19 @@ struct KSeq
     string qual;
 };
 
+/*! A read borrowed from a KSeqReader's buffers, without copying. The
+ *  pointers are only valid until the reader's next read.
+ */
+struct KSeqSpan
+{
+    const char *name;
+    size_t name_len;
+    const char *seq;
+    size_t seq_len;
+    const char *qual;
+    size_t qual_len;
+};
+
 
 class KSeqReader
 {
@@ -70,6 +83,20 @@ public:
         return true;
     }
 
+    bool next_read(KSeqSpan &ks)
+    {
+        if (_seq == nullptr) return false;
+        int l = kseq_read(_seq);
+        if (l < 1) return false;
+        ks.name = _seq->name.s;
+        ks.name_len = _seq->name.l;
+        ks.seq = _seq->seq.s;
+        ks.seq_len = _seq->seq.l;
+        ks.qual = _seq->qual.s;
+        ks.qual_len = _seq->qual.l;
+        return true;
+    }
+
     size_t next_chunk(vector<KSeq> &sequences, size_t max)
     {
         size_t count = 0;
@@ -83,6 +110,14 @@ public:
         return count;
     }
 
+    /* Bytes of the (possibly compressed) file read so far. Approximate, as
+     * zlib and kseq read ahead. */
+    size_t offset() const
+    {
+        if (_fp == nullptr) return 0;
+        return gzoffset(_fp);
+    }
+
 protected:
     gzFile _fp;
     kseq_t *_seq;
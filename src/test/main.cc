@@ -7,12 +7,19 @@
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 
+#include <algorithm>
+#include <map>
+#include <set>
+#include <random>
+
 #include "kmkm.hh"
+#include "kmexact.hh"
 
 using namespace kmkm;
 using namespace std;
 
-#include "test_kmercounter.cc"
 #include "test_kmeriterator.cc"
+#include "test_kmercounter.cc"
+#include "test_exactkmercounter.cc"
 
 // vim:set et sw=4 ts=4:
@@ -0,0 +1,283 @@
+// Copyright (c) 2017 Kevin Murray <kdmfoss@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+
+TEST_CASE("inthash64 inverse", "[ExactKmerCounter]") {
+    bool all_ok = true;
+    for (uint64_t i = 0; i < 10000; i++) {
+        const uint64_t x = i * UINT64_C(0x9e3779b97f4a7c15);
+        all_ok &= inthash64_inverse(inthash64(x)) == x;
+    }
+    REQUIRE(all_ok);
+}
+
+TEST_CASE("ExactKmerTable", "[ExactKmerCounter]") {
+    ExactKmerTable table(4);
+    map<uint64_t, uint64_t> expected;
+    for (uint64_t i = 0; i < 20000; i++) {
+        // Keys 0 to 4999, with key 0 (the free slot marker) included
+        const uint64_t key = i % 5000 == 0 ? 0 : inthash64(i % 5000);
+        table.add(key);
+        expected[key]++;
+    }
+    REQUIRE(table.size() == 5000);
+    REQUIRE(table.capacity() >= 5000 / ExactKmerTable::max_load);
+
+    bool all_ok = true;
+    for (const auto &kv: expected) {
+        all_ok &= table.get(kv.first) == kv.second;
+    }
+    REQUIRE(all_ok);
+    REQUIRE(table.get(inthash64(5001)) == 0);
+
+    size_t n = 0;
+    table.for_each([&](uint64_t key, uint64_t count) {
+        all_ok &= expected[key] == count;
+        n++;
+    });
+    REQUIRE(all_ok);
+    REQUIRE(n == 5000);
+}
+
+TEST_CASE("ExactKmerCounter", "[ExactKmerCounter]") {
+    vector<string> reads = _random_reads(2000);
+    // Reads overlap, so that k-mers have a range of counts
+    for (size_t r = 0; r < 500; r++) {
+        reads.push_back(reads[r].substr(r % 50, 100));
+    }
+
+    map<uint64_t, uint64_t> expected;
+    for (const auto &read: reads) {
+        KmerIterator ki(read, 21);
+        while (!ki.finished()) expected[ki.next()]++;
+    }
+
+    auto check = [&](const ExactKmerCounter<> &ctr) {
+        bool all_ok = true;
+        ctr.for_each([&](uint64_t kmer, uint64_t count) {
+            all_ok &= expected[kmer] == count;
+        });
+        return all_ok && ctr.size() == expected.size();
+    };
+
+    SECTION("serial") {
+        ExactKmerCounter<> ctr(21);
+        ctr.consume(reads);
+        REQUIRE(check(ctr));
+        bool all_ok = true;
+        for (const auto &kv: expected) {
+            string kmer;
+            for (int i = 20; i >= 0; i--) kmer += "ACGT"[(kv.first >> (2 * i)) & 3];
+            all_ok &= ctr.count(kmer) == kv.second;
+            all_ok &= ctr.count(_revcomp(kmer)) == kv.second;
+        }
+        REQUIRE(all_ok);
+        REQUIRE(ctr.count(string(21, 'A')) == expected[0]);
+        REQUIRE_THROWS(ctr.count("ACGT"));
+        REQUIRE_THROWS(ExactKmerCounter<>(33));
+    }
+
+    SECTION("compile-time k") {
+        ExactKmerCounter<21> ctr(21);
+        ctr.consume(reads);
+        size_t n = 0;
+        bool all_ok = true;
+        ctr.for_each([&](uint64_t kmer, uint64_t count) {
+            all_ok &= expected[kmer] == count;
+            n++;
+        });
+        REQUIRE(all_ok);
+        REQUIRE(n == expected.size());
+    }
+
+    SECTION("files, threads and saving") {
+        const string fname = "/tmp/kmkm_test_exact.fa";
+        _write_fasta(fname, reads);
+        for (int nthreads: {1, 2, 4}) {
+            ExactKmerCounter<> ctr(21);
+            REQUIRE(ctr.consume_from(fname, nthreads) == reads.size());
+            REQUIRE(check(ctr));
+        }
+        remove(fname.c_str());
+
+        ExactKmerCounter<> ctr(21);
+        ctr.consume(reads);
+        const string saved = "/tmp/kmkm_test_exact.kmx";
+        ctr.save(saved);
+        ExactKmerCounter<> loaded(saved);
+        REQUIRE(loaded.k() == 21);
+        REQUIRE(check(loaded));
+        remove(saved.c_str());
+    }
+}
+
+TEST_CASE("ExactKmerCounter k-mer hashing to 0", "[ExactKmerCounter]") {
+    // The only 32-mer whose hash is the free slot marker
+    const uint64_t kmer = inthash64_inverse(0);
+    string seq;
+    for (int i = 31; i >= 0; i--) seq += "ACGT"[(kmer >> (2 * i)) & 3];
+    ExactKmerCounter<> ctr(32, false);
+    ctr.consume(seq);
+    ctr.consume(seq);
+    REQUIRE(ctr.size() == 1);
+    REQUIRE(ctr.count(seq) == 2);
+}
+
+TEST_CASE("ConcurrentKmerTable", "[ConcurrentKmerCounter]") {
+    // Tiny, so that threads add through many online resizes
+    ConcurrentKmerTable table(16);
+    const uint64_t nkeys = 20000;
+    #pragma omp parallel for num_threads(4) schedule(dynamic, 1000)
+    for (uint64_t i = 0; i < 4 * nkeys; i++) {
+        // Include the free and moved slot markers as keys
+        const uint64_t j = i % nkeys;
+        const uint64_t key = j == 0 ? 0 : j == 1 ? ConcurrentKmerTable::moved_key : inthash64(j);
+        table.add(key, 1 + j % 3);
+    }
+    table.finish_migration();
+    REQUIRE(table.size() == nkeys);
+    REQUIRE(table.capacity() >= nkeys / ConcurrentKmerTable::max_load);
+
+    bool all_ok = true;
+    for (uint64_t j = 2; j < nkeys; j++) {
+        all_ok &= table.get(inthash64(j)) == 4 * (1 + j % 3);
+    }
+    REQUIRE(all_ok);
+    REQUIRE(table.get(0) == 4);
+    REQUIRE(table.get(ConcurrentKmerTable::moved_key) == 8);
+    REQUIRE(table.get(inthash64(nkeys)) == 0);
+
+    uint64_t total = 0;
+    table.for_each([&](uint64_t, uint64_t count) { total += count; });
+    uint64_t expected = 0;
+    for (uint64_t j = 0; j < nkeys; j++) expected += 4 * (1 + j % 3);
+    REQUIRE(total == expected);
+
+    table.clear();
+    REQUIRE(table.size() == 0);
+}
+
+TEST_CASE("ConcurrentKmerCounter", "[ConcurrentKmerCounter]") {
+    vector<string> reads = _random_reads(2000);
+    for (size_t r = 0; r < 500; r++) {
+        reads.push_back(reads[r].substr(r % 50, 100));
+    }
+
+    map<uint64_t, uint64_t> expected;
+    for (const auto &read: reads) {
+        KmerIterator ki(read, 21);
+        while (!ki.finished()) expected[ki.next()]++;
+    }
+
+    auto check = [&](const ConcurrentKmerCounter<> &ctr) {
+        bool all_ok = true;
+        ctr.for_each([&](uint64_t kmer, uint64_t count) {
+            all_ok &= expected[kmer] == count;
+        });
+        return all_ok && ctr.size() == expected.size();
+    };
+
+    SECTION("serial") {
+        ConcurrentKmerCounter<> ctr(21, true, 16);
+        ctr.consume(reads);
+        REQUIRE(check(ctr));
+        REQUIRE(ctr.count(string(21, 'A')) == expected[0]);
+        REQUIRE_THROWS(ctr.count("ACGT"));
+        REQUIRE_THROWS(ConcurrentKmerCounter<>(33));
+    }
+
+    SECTION("files, threads and saving") {
+        const string fname = "/tmp/kmkm_test_concurrent.fa";
+        _write_fasta(fname, reads);
+        for (int nthreads: {1, 2, 4}) {
+            ConcurrentKmerCounter<21> ctr(21, true, 16);
+            REQUIRE(ctr.consume_from(fname, nthreads) == reads.size());
+            size_t n = 0;
+            bool all_ok = true;
+            ctr.for_each([&](uint64_t kmer, uint64_t count) {
+                all_ok &= expected[kmer] == count;
+                n++;
+            });
+            REQUIRE(all_ok);
+            REQUIRE(n == expected.size());
+        }
+
+        ConcurrentKmerCounter<> ctr(21);
+        REQUIRE(ctr.consume_from(fname, 4) == reads.size());
+        remove(fname.c_str());
+        const string saved = "/tmp/kmkm_test_concurrent.kmx";
+        ctr.save(saved);
+        ConcurrentKmerCounter<> loaded(saved);
+        REQUIRE(loaded.k() == 21);
+        REQUIRE(check(loaded));
+        remove(saved.c_str());
+    }
+}
+
+TEST_CASE("BinnedKmerCounter", "[BinnedKmerCounter]") {
+    vector<string> reads = _random_reads(2000);
+    for (size_t r = 0; r < 500; r++) {
+        reads.push_back(reads[r].substr(r % 50, 100));
+    }
+    const string fname = "/tmp/kmkm_test_binned.fa";
+    _write_fasta(fname, reads);
+
+    for (bool canonical: {true, false}) {
+        map<uint64_t, uint64_t> expected;
+        for (const auto &read: reads) {
+            KmerIterator ki(read, 21, canonical);
+            while (!ki.finished()) expected[ki.next()]++;
+        }
+        auto check = [&](const BinnedKmerCounter<> &ctr, uint64_t times) {
+            bool all_ok = true;
+            size_t n = 0;
+            ctr.for_each([&](uint64_t kmer, uint64_t count) {
+                all_ok &= expected[kmer] * times == count;
+                n++;
+            });
+            return all_ok && n == expected.size() && ctr.size() == expected.size();
+        };
+
+        for (int nthreads: {1, 2, 4}) {
+            BinnedKmerCounter<> ctr(21, canonical, 16);
+            REQUIRE(ctr.consume_from(fname, nthreads) == reads.size());
+            REQUIRE(check(ctr, 1));
+            // Counting again adds to the saved bins
+            ctr.consume_from(fname, nthreads);
+            REQUIRE(check(ctr, 2));
+        }
+    }
+
+    SECTION("super-k-mers") {
+        BinnedKmerCounter<> ctr(21, true, 4, "/tmp");
+        const PackedSeq seq(reads[0].data(), reads[0].size());
+        size_t nkmers = 0;
+        ctr.super_kmers(seq, [&](size_t start, size_t len, uint64_t minimizer) {
+            const string span = reads[0].substr(start, len);
+            REQUIRE(span.find('N') == string::npos);
+            REQUIRE(len >= 21);
+            nkmers += len - 20;
+            // Every k-mer in the span has the span's minimizer
+            for (size_t i = 0; i + 21 <= len; i++) {
+                KmerIterator mi(span.substr(i, 21), 11);
+                uint64_t kmer_min = ~UINT64_C(0);
+                while (!mi.finished()) kmer_min = min(kmer_min, mi.next_hashed());
+                REQUIRE(kmer_min == minimizer);
+            }
+        });
+        KmerIterator ki(reads[0], 21);
+        size_t expected = 0;
+        while (!ki.finished()) ki.next(), expected++;
+        REQUIRE(nkmers == expected);
+
+        const string dir = ctr.directory();
+        REQUIRE(boost::filesystem::is_directory(dir));
+        REQUIRE(dir.compare(0, 5, "/tmp/") == 0);
+    }
+    remove(fname.c_str());
+}
+
+// vim:set et sw=4 ts=4:
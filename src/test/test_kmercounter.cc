@@ -30,8 +30,773 @@ TEST_CASE("KmerCounter init", "[KmerCounter]") {
         REQUIRE(ctr.nnz() == 1);
         REQUIRE(ctr.collision_rate() == 1.0/double(cvsize));
     }
+
+    SECTION("Move") {
+        ctr.consume("AAAA");
+        KmerCounter<uint8_t> other(5, 100, false, 2);
+        other = std::move(ctr);
+        REQUIRE(other.k() == k);
+        REQUIRE(other.buckets() == cvsize);
+        REQUIRE(other.nnz() == 1);
+        KmerCounter<uint8_t> moved(std::move(other));
+        REQUIRE(moved.nnz() == 1);
+    }
+}
+
+TEST_CASE("KmerCounter compile-time k", "[KmerCounter]") {
+    string seq;
+    for (size_t i = 0; i < 500; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    for (int k: {15, 21, 22}) {
+        KmerCounter<uint8_t> ctr(k, 1000);
+        KmerIterator ki(seq, k);
+        vector<uint8_t> expected(1000, 0);
+        while (!ki.finished()) {
+            expected[ki.next_hashed() % 1000]++;
+        }
+        ctr.consume(seq);
+        REQUIRE(ctr.counts() == expected);
+    }
+
+    KmerCounter<uint8_t> rt(21, 1000);
+    KmerCounter<uint8_t, 21> ct(21, 1000);
+    rt.consume(seq);
+    ct.consume(seq);
+    REQUIRE(ct.counts() == rt.counts());
+    REQUIRE_THROWS((KmerCounter<uint8_t, 21>(31, 1000)));
+}
+
+TEST_CASE("KmerCounter k > 32", "[KmerCounter]") {
+    string seq;
+    for (size_t i = 0; i < 500; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    string rc(seq.rbegin(), seq.rend());
+    for (auto &c: rc) {
+        c = "TGCA"[string("ACGT").find(c)];
+    }
+
+    KmerCounter<uint8_t> fwd(45, 1000), rev(45, 1000);
+    fwd.consume(seq);
+    rev.consume(rc);
+    REQUIRE(fwd.nnz() > 0);
+    REQUIRE(fwd.counts() == rev.counts());
+
+    KmerCounter<uint8_t, 45> ct(45, 1000);
+    ct.consume(seq);
+    REQUIRE(ct.counts() == fwd.counts());
+
+    // Only ntHash hashes k-mers longer than max_k
+    KmerCounter<uint8_t> inthash(65, 1000);
+    REQUIRE_THROWS_AS(inthash.consume(seq), const invalid_argument &);
+    KmerCounter<uint8_t> nthash(80, 1000), nthash_rev(80, 1000);
+    nthash.set_hash_mode(HASH_NTHASH);
+    nthash_rev.set_hash_mode(HASH_NTHASH);
+    nthash.consume(seq);
+    nthash_rev.consume(rc);
+    REQUIRE(nthash.nnz() > 0);
+    REQUIRE(nthash.counts() == nthash_rev.counts());
+    REQUIRE_THROWS_AS(nthash.set_hash_mode(HASH_INTHASH), const invalid_argument &);
+    REQUIRE_THROWS_AS(KmerCounter<uint8_t>(0, 1000), const invalid_argument &);
+}
+
+TEST_CASE("KmerCounter hash modes", "[KmerCounter]") {
+    const string seq = "ACGTTGCATGACCATGACGATCAGCAGCGACAGCATCAGCCGATATGCAGCTAACAGCGAC";
+    KmerCounter<uint8_t> ctr(21, 1000);
+    ctr.set_hash_mode(HASH_NTHASH);
+    ctr.consume(seq);
+
+    vector<uint8_t> expected(1000, 0);
+    NtHashIterator ki(seq, 21);
+    while (!ki.finished()) {
+        expected[ki.next_hashed() % 1000]++;
+    }
+    REQUIRE(ctr.counts() == expected);
+
+    SECTION("hash mode is saved") {
+        const string fname = "/tmp/kmkm_test_hashmode.kmr";
+        ctr.save(fname);
+        KmerCounter<uint8_t> loaded(fname);
+        REQUIRE(loaded.hash_mode() == HASH_NTHASH);
+        REQUIRE(loaded.counts() == expected);
+        remove(fname.c_str());
+    }
+}
+
+TEST_CASE("KmerCounter direct indexing", "[KmerCounter]") {
+    SECTION("indices") {
+        for (unsigned int k = 1; k <= 8; k++) {
+            const uint64_t space = kmer_direct_space(k);
+            vector<bool> seen(space, false);
+            size_t distinct = 0;
+            bool all_ok = true;
+            for (uint64_t kmer = 0; kmer < (UINT64_C(1) << (2 * k)); kmer++) {
+                const uint64_t idx = kmer_direct_index(kmer, k);
+                all_ok &= idx < space;
+                all_ok &= idx == kmer_direct_index(kmer_revcomp(kmer, k), k);
+                if (idx < space && kmer <= kmer_revcomp(kmer, k)) {
+                    // Only a k-mer's canonical form may claim its index
+                    all_ok &= !seen[idx];
+                    seen[idx] = true;
+                    distinct++;
+                }
+            }
+            REQUIRE(all_ok);
+            REQUIRE(distinct == space);
+        }
+        REQUIRE(kmer_direct_space(13, false) == UINT64_C(1) << 26);
+        REQUIRE(kmer_direct_index(12345, 13, false) == 12345);
+    }
+
+    string seq;
+    for (size_t i = 0; i < 5000; i++) {
+        seq += "ACGTN"[inthash64(i) % 41 % 5];
+    }
+    for (int k: {11, 12}) {
+        KmerCounter<uint16_t> ctr(k, 1000);
+        ctr.set_hash_mode(HASH_DIRECT);
+        REQUIRE(ctr.buckets() == kmer_direct_space(k));
+        ctr.consume(seq);
+
+        map<uint64_t, uint16_t> expected;
+        KmerIterator ki(seq, k);
+        while (!ki.finished()) expected[ki.next()]++;
+        bool all_ok = true;
+        for (const auto &kv: expected) {
+            all_ok &= ctr.query(kmer_direct_index(kv.first, k)) == kv.second;
+        }
+        REQUIRE(all_ok);
+        REQUIRE(ctr.nnz() == expected.size());
+    }
+
+    SECTION("packed, threads and saving") {
+        const string fname = "/tmp/kmkm_test_direct.fa";
+        _write_fasta(fname, vector<string>(20, seq));
+        KmerCounter<uint8_t> serial(13, 1000);
+        serial.set_hash_mode(HASH_DIRECT);
+        serial.consume_from(fname);
+        KmerCounter<uint8_t> threaded(13, 1000);
+        threaded.set_counter_mode(COUNTER_PACKED4);
+        threaded.set_hash_mode(HASH_DIRECT);
+        REQUIRE(threaded.buckets() == kmer_direct_space(13));
+        threaded.consume_from(fname, 2);
+        REQUIRE(threaded.export_counts() == serial.counts());
+        remove(fname.c_str());
+
+        const string saved = "/tmp/kmkm_test_direct.kmr";
+        threaded.save(saved);
+        KmerCounter<uint8_t> loaded(saved);
+        REQUIRE(loaded.hash_mode() == HASH_DIRECT);
+        REQUIRE(loaded.export_counts() == serial.counts());
+        remove(saved.c_str());
+    }
+
+    REQUIRE_THROWS_AS(KmerCounter<uint8_t>(15, 1000).set_hash_mode(HASH_DIRECT),
+                      const invalid_argument &);
+    REQUIRE_THROWS_AS(KmerCounter<uint8_t>(11, 1000, true, 2).set_hash_mode(HASH_DIRECT),
+                      const invalid_argument &);
+}
+
+TEST_CASE("KmerCounter scaled", "[KmerCounter]") {
+    string seq;
+    for (size_t i = 0; i < 20000; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    KmerCounter<uint8_t> ctr(21, 1000);
+    ctr.set_scale(10);
+    REQUIRE(ctr.max_hash() == numeric_limits<uint64_t>::max() / 10);
+    ctr.consume(seq);
+
+    vector<uint8_t> expected(1000, 0);
+    size_t kept = 0, total = 0;
+    KmerIterator ki(seq, 21);
+    while (!ki.finished()) {
+        const uint64_t hash = ki.next_hashed();
+        total++;
+        if (hash > ctr.max_hash()) continue;
+        expected[hash % 1000]++;
+        kept++;
+    }
+    REQUIRE(ctr.counts() == expected);
+    // Roughly one in ten k-mers is kept
+    REQUIRE(kept > total / 20);
+    REQUIRE(kept < total / 5);
+
+    SECTION("threads and saving") {
+        const string fname = "/tmp/kmkm_test_scaled.fa";
+        _write_fasta(fname, {seq});
+        for (auto mode: {PARALLEL_ATOMIC, PARALLEL_SHARDED, PARALLEL_RANGE}) {
+            KmerCounter<uint8_t> threaded(21, 1000);
+            threaded.set_scale(10);
+            threaded.set_parallel_mode(mode);
+            threaded.consume_from(fname, 2);
+            REQUIRE(threaded.counts() == expected);
+        }
+        remove(fname.c_str());
+
+        const string saved = "/tmp/kmkm_test_scaled.kmr";
+        ctr.save(saved);
+        KmerCounter<uint8_t> loaded(saved);
+        REQUIRE(loaded.scale() == 10);
+        REQUIRE(loaded.counts() == expected);
+        remove(saved.c_str());
+    }
+
+    SECTION("mismatches") {
+        KmerCounter<uint8_t> unscaled(21, 1000);
+        REQUIRE_THROWS_AS(ctr.merge(unscaled), const invalid_argument &);
+        KmerCounter<uint8_t> direct(11, 1000);
+        direct.set_hash_mode(HASH_DIRECT);
+        REQUIRE_THROWS_AS(direct.set_scale(10), const invalid_argument &);
+        KmerCounter<uint8_t> scaled(11, 1000);
+        scaled.set_scale(10);
+        REQUIRE_THROWS_AS(scaled.set_hash_mode(HASH_DIRECT), const invalid_argument &);
+    }
+}
+
+TEST_CASE("BottomKSketch", "[KmerCounter]") {
+    BottomKSketch sketch(100);
+    map<uint64_t, uint64_t> expected;
+    for (uint64_t i = 0; i < 50000; i++) {
+        const uint64_t hash = inthash64(i % 7000);
+        sketch.add(hash);
+        expected[hash]++;
+    }
+    sketch.flush();
+    REQUIRE(sketch.hashes().size() == 100);
+    auto it = expected.begin();
+    bool all_ok = true;
+    for (size_t i = 0; i < 100; i++, it++) {
+        all_ok &= sketch.hashes()[i] == it->first;
+        all_ok &= sketch.counts()[i] == it->second;
+    }
+    REQUIRE(all_ok);
+
+    SECTION("jaccard") {
+        // Sets of 20000 sharing 10000, so J = 1/3
+        BottomKSketch a(1000), b(1000);
+        for (uint64_t i = 0; i < 20000; i++) {
+            a.add(inthash64(i));
+            b.add(inthash64(i + 10000));
+        }
+        a.flush();
+        b.flush();
+        REQUIRE(a.jaccard(a) == 1.0);
+        REQUIRE(fabs(a.jaccard(b) - 1.0 / 3) < 0.05);
+        REQUIRE(a.jaccard(BottomKSketch(1000)) == 0.0);
+    }
+}
+
+TEST_CASE("KmerCounter bottom-k sketch", "[KmerCounter]") {
+    string seq;
+    for (size_t i = 0; i < 20000; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    // Repeat part of the sequence, so that some k-mers are abundant
+    seq += seq.substr(0, 5000);
+    KmerCounter<uint8_t> ctr(21, 1000);
+    ctr.set_sketch_size(50);
+    ctr.set_scale(10);
+    ctr.consume(seq);
+    ctr.flush();
+
+    BottomKSketch expected(50);
+    KmerIterator ki(seq, 21);
+    while (!ki.finished()) expected.add(ki.next_hashed());
+    expected.flush();
+    REQUIRE(ctr.sketch().hashes() == expected.hashes());
+    REQUIRE(ctr.sketch().counts() == expected.counts());
+    REQUIRE(*max_element(expected.counts().begin(), expected.counts().end()) >= 2);
+
+    SECTION("threads, merging and saving") {
+        const string fname = "/tmp/kmkm_test_bottomk.fa";
+        vector<string> chunks;
+        for (size_t i = 0; i < seq.size(); i += 1000) chunks.push_back(seq.substr(i, 1020));
+        _write_fasta(fname, chunks);
+        for (auto mode: {PARALLEL_ATOMIC, PARALLEL_SHARDED, PARALLEL_RANGE}) {
+            KmerCounter<uint8_t> threaded(21, 1000);
+            threaded.set_sketch_size(50);
+            threaded.set_parallel_mode(mode);
+            threaded.consume_from(fname, 3);
+            REQUIRE(threaded.sketch().hashes() == expected.hashes());
+            REQUIRE(threaded.sketch().counts() == expected.counts());
+        }
+        remove(fname.c_str());
+
+        KmerCounter<uint8_t> other(21, 1000);
+        other.set_sketch_size(50);
+        other.set_scale(10);
+        other.consume(seq);
+        ctr.merge(other);
+        vector<uint64_t> doubled(expected.counts());
+        for (auto &c: doubled) c *= 2;
+        REQUIRE(ctr.sketch().hashes() == expected.hashes());
+        REQUIRE(ctr.sketch().counts() == doubled);
+
+        const string saved = "/tmp/kmkm_test_bottomk.kmr";
+        ctr.save(saved);
+        KmerCounter<uint8_t> loaded(saved);
+        REQUIRE(loaded.sketch().capacity() == 50);
+        REQUIRE(loaded.sketch().counts() == doubled);
+        remove(saved.c_str());
+
+        KmerCounter<uint8_t> unsketched(21, 1000);
+        unsketched.set_scale(10);
+        REQUIRE_THROWS_AS(ctr.merge(unsketched), const invalid_argument &);
+    }
+}
+
+TEST_CASE("HyperLogLog", "[KmerCounter]") {
+    SECTION("estimates") {
+        for (uint64_t n: {100, 10000, 1000000}) {
+            HyperLogLog hll;
+            for (uint64_t i = 0; i < n; i++) {
+                // Each hash twice
+                hll.add(inthash64(i));
+                hll.add(inthash64(i));
+            }
+            REQUIRE(fabs(hll.estimate() / n - 1) < 0.03);
+        }
+        HyperLogLog a(12), b(12), both(12);
+        for (uint64_t i = 0; i < 50000; i++) {
+            a.add(inthash64(i));
+            b.add(inthash64(i + 25000));
+            both.add(inthash64(i));
+            both.add(inthash64(i + 25000));
+        }
+        a.merge(b);
+        REQUIRE(a.estimate() == both.estimate());
+        REQUIRE_THROWS_AS(a.merge(HyperLogLog(14)), const invalid_argument &);
+        REQUIRE_THROWS_AS(HyperLogLog(2), const invalid_argument &);
+    }
+
+    SECTION("k-mers in files, and sizing a counter") {
+        const vector<string> reads = _random_reads(1000);
+        set<uint64_t> distinct;
+        for (const auto &seq: reads) {
+            KmerIterator ki(seq, 21);
+            while (!ki.finished()) distinct.insert(ki.next());
+        }
+        const string fname = "/tmp/kmkm_test_hll.fa";
+        _write_fasta(fname, reads);
+        for (int nthreads: {1, 3}) {
+            HyperLogLog hll;
+            REQUIRE(hll.consume_from(fname, 21, true, nthreads) == reads.size());
+            REQUIRE(fabs(hll.estimate() / distinct.size() - 1) < 0.03);
+        }
+        // Reads are random, so distinct k-mers grow linearly with the prefix;
+        // readahead makes the fraction read approximate
+        HyperLogLog prefix, whole;
+        const double frac = prefix.consume_prefix(fname, 21, true, 500);
+        REQUIRE(frac > 0.45);
+        REQUIRE(frac < 0.7);
+        REQUIRE(fabs(prefix.estimate() / frac / distinct.size() - 1) < 0.3);
+        REQUIRE(whole.consume_prefix(fname, 21, true, 1000) == 1.0);
+        REQUIRE(fabs(whole.estimate() / distinct.size() - 1) < 0.03);
+
+        HyperLogLog hll;
+        hll.consume_from(fname, 21);
+        const size_t buckets = KmerCounter<uint8_t>::buckets_for(hll.estimate(), 0.1);
+        KmerCounter<uint8_t> ctr(21, buckets);
+        ctr.consume_from(fname);
+        REQUIRE(fabs(ctr.collision_rate() - 0.1) < 0.01);
+        remove(fname.c_str());
+
+        REQUIRE(KmerCounter<uint8_t>::buckets_for(0, 0.5) == 1);
+        REQUIRE_THROWS_AS(KmerCounter<uint8_t>::buckets_for(1000, 1.0), const invalid_argument &);
+    }
+}
+
+TEST_CASE("KmerCounter count-min sketch", "[KmerCounter]") {
+    // 20000 distinct hashes, hash h seen h % 7 + 1 times
+    vector<uint64_t> hashes;
+    for (uint64_t i = 0; i < 20000; i++) {
+        const uint64_t h = inthash64(i);
+        for (uint64_t j = 0; j <= h % 7; j++) hashes.push_back(h);
+    }
+    std::shuffle(hashes.begin(), hashes.end(), std::mt19937(42));
+
+    SECTION("exact when wide") {
+        KmerCounter<uint8_t> ctr(21, 1000, true, 4, 1 << 20);
+        ctr.count_batch(hashes.data(), hashes.size());
+        bool all_ok = true;
+        for (uint64_t i = 0; i < 20000; i++) {
+            all_ok &= ctr.query(inthash64(i)) == inthash64(i) % 7 + 1;
+        }
+        REQUIRE(all_ok);
+    }
+
+    SECTION("sketch replaces the count vector") {
+        KmerCounter<uint8_t> ctr(21, 40000, true, 4);
+        REQUIRE(ctr.counts().empty());
+        REQUIRE(ctr.buckets() == 40000);
+        ctr.count_batch(hashes.data(), hashes.size());
+        REQUIRE(ctr.nnz() > 0);
+        REQUIRE(ctr.export_counts().size() == 40000);
+        REQUIRE(ctr.bucket_count(0) == ctr.data()[0]);
+    }
+
+    SECTION("never underestimates, beats a single table") {
+        // Four rows in the memory of one 40000 bucket vector
+        KmerCounter<uint8_t> sketch(21, 1000, true, 4, 10000), single(21, 40000);
+        sketch.count_batch(hashes.data(), hashes.size());
+        single.count_batch(hashes.data(), hashes.size());
+        bool all_ok = true;
+        size_t sketch_err = 0, single_err = 0;
+        for (uint64_t i = 0; i < 20000; i++) {
+            const uint64_t h = inthash64(i);
+            all_ok &= sketch.query(h) >= h % 7 + 1;
+            sketch_err += sketch.query(h) - (h % 7 + 1);
+            single_err += single.query(h) - (h % 7 + 1);
+        }
+        REQUIRE(all_ok);
+        REQUIRE(sketch_err < single_err);
+    }
+
+    SECTION("blocked layout") {
+        KmerCounter<uint8_t> wide(21, 1000, true, 4, 1 << 20);
+        KmerCounter<uint8_t> narrow(21, 1000, true, 4, 10000);
+        wide.set_sketch_layout(SKETCH_BLOCKED);
+        narrow.set_sketch_layout(SKETCH_BLOCKED);
+        wide.count_batch(hashes.data(), hashes.size());
+        narrow.count_batch(hashes.data(), hashes.size());
+        bool exact = true, over = true;
+        for (uint64_t i = 0; i < 20000; i++) {
+            const uint64_t h = inthash64(i);
+            exact &= wide.query(h) == h % 7 + 1;
+            over &= narrow.query(h) >= h % 7 + 1;
+        }
+        REQUIRE(exact);
+        REQUIRE(over);
+        KmerCounter<uint8_t> deep(21, 1000, true, 65);
+        REQUIRE_THROWS_AS(deep.set_sketch_layout(SKETCH_BLOCKED), const invalid_argument &);
+    }
+
+    SECTION("sketch is saved") {
+        KmerCounter<uint8_t> ctr(21, 1000, true, 3, 5000);
+        ctr.set_sketch_layout(SKETCH_BLOCKED);
+        ctr.count_batch(hashes.data(), hashes.size());
+        const string fname = "/tmp/kmkm_test_countmin.kmr";
+        ctr.save(fname);
+        KmerCounter<uint8_t> loaded(fname);
+        REQUIRE(loaded.sketch_layout() == SKETCH_BLOCKED);
+        REQUIRE(loaded.export_counts() == ctr.export_counts());
+        bool all_ok = true;
+        for (uint64_t i = 0; i < 20000; i++) {
+            all_ok &= loaded.query(inthash64(i)) == ctr.query(inthash64(i));
+        }
+        REQUIRE(all_ok);
+        remove(fname.c_str());
+    }
+}
+
+TEST_CASE("KmerCounter spans and files", "[KmerCounter]") {
+    vector<string> reads = _random_reads(3000);
+    KmerCounter<uint8_t> expected(21, 100000);
+    expected.consume(reads);
+
+    SECTION("span") {
+        KmerCounter<uint8_t> ctr(21, 100000);
+        const string buf = reads[0] + reads[1];
+        ctr.consume(buf.data(), 150);
+        ctr.consume(boost::string_view(buf).substr(150));
+        for (size_t r = 2; r < reads.size(); r++) ctr.consume(reads[r]);
+        REQUIRE(ctr.counts() == expected.counts());
+    }
+
+    SECTION("batch") {
+        KmerCounter<uint8_t> ctr(21, 100000);
+        for (const auto &read: reads) {
+            KmerIterator ki(read, 21);
+            vector<uint64_t> hashes(ki.size());
+            hashes.resize(ki.next_hashed_batch(hashes.data(), hashes.size()));
+            ctr.count_batch(hashes.data(), hashes.size());
+        }
+        REQUIRE(ctr.counts() == expected.counts());
+    }
+
+    SECTION("prefetch") {
+        for (size_t dist: {1, 16, 1000}) {
+            KmerCounter<uint8_t> ctr(21, 100000);
+            ctr.set_prefetch_distance(dist);
+            ctr.consume(reads);
+            REQUIRE(ctr.counts() == expected.counts());
+        }
+    }
+
+    SECTION("partitioned engine") {
+        // Large enough for several partitions
+        KmerCounter<uint16_t> direct(21, 1000000), part(21, 1000000);
+        part.set_engine(ENGINE_PARTITIONED);
+        direct.consume(reads);
+        for (const auto &read: reads) part.consume(read);
+        part.flush();
+        REQUIRE(part.nnz() > 0);
+        REQUIRE(part.counts() == direct.counts());
+
+        // Staged counts are applied before reads and merges, without flush()
+        KmerCounter<uint16_t> staged(21, 1000000), merged(21, 1000000), queried(21, 1000000);
+        staged.set_engine(ENGINE_PARTITIONED);
+        queried.set_engine(ENGINE_PARTITIONED);
+        for (const auto &read: reads) staged.consume(read);
+        merged.merge(staged);
+        REQUIRE(merged.nnz() == direct.nnz());
+        REQUIRE(merged.counts() == direct.counts());
+        for (const auto &read: reads) queried.consume(read);
+        bool all_ok = true;
+        for (KmerIterator ki(reads[0], 21); !ki.finished();) {
+            const uint64_t h = ki.next_hashed();
+            all_ok &= queried.query(h) == direct.query(h);
+        }
+        REQUIRE(all_ok);
+        REQUIRE(queried.nnz() == direct.nnz());
+    }
+
+    SECTION("packed counters") {
+        KmerCounter<uint8_t> packed(21, 100000), part(21, 100000);
+        packed.set_counter_mode(COUNTER_PACKED4);
+        part.set_counter_mode(COUNTER_PACKED4);
+        part.set_engine(ENGINE_PARTITIONED);
+        packed.consume(reads);
+        part.consume(reads);
+        REQUIRE(packed.counts().size() == 50000);
+        REQUIRE(packed.buckets() == 100000);
+        REQUIRE(packed.nnz() == expected.nnz());
+        REQUIRE(packed.collision_rate() == expected.collision_rate());
+        REQUIRE(packed.export_counts() == expected.counts());
+        REQUIRE(part.export_counts() == expected.counts());
+
+        KmerCounter<uint8_t> twice(21, 100000);
+        twice.consume(reads);
+        twice.consume(reads);
+        packed.merge(part);
+        REQUIRE(packed.export_counts() == twice.counts());
+
+        const string fname = "/tmp/kmkm_test_packed.kmr";
+        packed.save(fname);
+        KmerCounter<uint8_t> loaded(fname);
+        REQUIRE(loaded.counter_mode() == COUNTER_PACKED4);
+        REQUIRE(loaded.export_counts() == twice.counts());
+        remove(fname.c_str());
+
+        KmerCounter<uint16_t> wide(21, 100000);
+        REQUIRE_THROWS_AS(wide.set_counter_mode(COUNTER_PACKED4), const invalid_argument &);
+
+        KmerCounter<uint8_t> switched(21, 100000);
+        switched.set_counter_mode(COUNTER_PACKED4);
+        REQUIRE(switched.overflow_enabled());
+        switched.set_counter_mode(COUNTER_LINEAR);
+        REQUIRE_FALSE(switched.overflow_enabled());
+        REQUIRE(switched.buckets() == 100000);
+        switched.consume(reads);
+        REQUIRE(switched.counts() == expected.counts());
+        REQUIRE(switched.overflow().empty());
+    }
+
+    SECTION("file") {
+        const string fname = "/tmp/kmkm_test_reads.fa";
+        _write_fasta(fname, reads);
+        KmerCounter<uint8_t> ctr(21, 100000);
+        REQUIRE(ctr.consume_from(fname) == reads.size());
+        REQUIRE(ctr.counts() == expected.counts());
+
+        for (int nthreads: {2, 4}) {
+            KmerCounter<uint8_t> threaded(21, 100000);
+            REQUIRE(threaded.consume_from(fname, nthreads) == reads.size());
+            REQUIRE(threaded.counts() == expected.counts());
+        }
+
+        for (int nthreads: {2, 4}) {
+            KmerCounter<uint8_t> sharded(21, 100000);
+            sharded.set_parallel_mode(PARALLEL_SHARDED);
+            REQUIRE(sharded.consume_from(fname, nthreads) == reads.size());
+            REQUIRE(sharded.counts() == expected.counts());
+        }
+
+        for (int nthreads: {2, 5}) {
+            KmerCounter<uint8_t> ranged(21, 100000);
+            ranged.set_parallel_mode(PARALLEL_RANGE);
+            REQUIRE(ranged.consume_from(fname, nthreads) == reads.size());
+            REQUIRE(ranged.counts() == expected.counts());
+        }
+
+        for (auto mode: {PARALLEL_ATOMIC, PARALLEL_SHARDED, PARALLEL_RANGE}) {
+            KmerCounter<uint8_t> packed(21, 100000);
+            packed.set_counter_mode(COUNTER_PACKED4);
+            packed.set_parallel_mode(mode);
+            REQUIRE(packed.consume_from(fname, 3) == reads.size());
+            REQUIRE(packed.export_counts() == expected.counts());
+        }
+
+        // Sharded count-min sketches never underestimate; other parallel
+        // modes can't update them conservatively
+        map<uint64_t, uint64_t> truth;
+        for (const auto &read: reads) {
+            for (KmerIterator ki(read, 21); !ki.finished();) truth[ki.next_hashed()]++;
+        }
+        KmerCounter<uint8_t> sketch(21, 20000, true, 4);
+        sketch.set_parallel_mode(PARALLEL_SHARDED);
+        REQUIRE(sketch.consume_from(fname, 3) == reads.size());
+        bool all_ok = true;
+        for (const auto &it: truth) all_ok &= sketch.query(it.first) >= it.second;
+        REQUIRE(all_ok);
+        KmerCounter<uint8_t> atomic_sketch(21, 20000, true, 4);
+        REQUIRE_THROWS_AS(atomic_sketch.consume_from(fname, 3), const invalid_argument &);
+
+        KmerCounter<uint8_t> nthash(21, 100000), nthash_threaded(21, 100000);
+        nthash.set_hash_mode(HASH_NTHASH);
+        nthash_threaded.set_hash_mode(HASH_NTHASH);
+        nthash.consume_from(fname);
+        nthash_threaded.consume_from(fname, 3);
+        REQUIRE(nthash_threaded.counts() == nthash.counts());
+        remove(fname.c_str());
+    }
+}
+
+TEST_CASE("KmerCounter saturation and overflow", "[KmerCounter]") {
+    // 100 reads of 147 AAAA k-mers each
+    const vector<string> reads(100, string(150, 'A'));
+    const size_t aaaa = KmerIterator("AAAA", 4).next_hashed() % 100;
+
+    SECTION("saturates") {
+        KmerCounter<uint8_t> ctr(4, 100);
+        ctr.consume(reads);
+        REQUIRE(ctr.counts()[aaaa] == 255);
+        REQUIRE(ctr.bucket_count(aaaa) == 255);
+        REQUIRE(ctr.overflow().empty());
+    }
+
+    SECTION("spills") {
+        for (auto engine: {ENGINE_DIRECT, ENGINE_PARTITIONED}) {
+            KmerCounter<uint8_t> ctr(4, 100);
+            ctr.set_engine(engine);
+            ctr.set_overflow(true);
+            ctr.consume(reads);
+            REQUIRE(ctr.counts()[aaaa] == 255);
+            REQUIRE(ctr.bucket_count(aaaa) == 14700);
+
+            KmerCounter<uint8_t> packed(4, 100);
+            packed.set_counter_mode(COUNTER_PACKED4);
+            packed.set_engine(engine);
+            packed.consume(reads);
+            REQUIRE(packed.bucket_count(aaaa) == 14700);
+            REQUIRE(packed.export_counts<uint16_t>()[aaaa] == 14700);
+        }
+    }
+
+    SECTION("threads") {
+        const string fname = "/tmp/kmkm_test_overflow.fa";
+        _write_fasta(fname, reads);
+        for (auto mode: {PARALLEL_ATOMIC, PARALLEL_SHARDED, PARALLEL_RANGE}) {
+            KmerCounter<uint8_t> saturated(4, 100), spilled(4, 100);
+            saturated.set_parallel_mode(mode);
+            spilled.set_parallel_mode(mode);
+            spilled.set_overflow(true);
+            saturated.consume_from(fname, 3);
+            spilled.consume_from(fname, 3);
+            REQUIRE(saturated.bucket_count(aaaa) == 255);
+            REQUIRE(spilled.bucket_count(aaaa) == 14700);
+        }
+        remove(fname.c_str());
+    }
+
+    SECTION("saved and merged") {
+        KmerCounter<uint8_t> a(4, 100), b(4, 100);
+        a.set_overflow(true);
+        b.set_overflow(true);
+        a.consume(reads);
+        b.consume(reads);
+        const string fname = "/tmp/kmkm_test_overflow.kmr";
+        b.save(fname);
+        KmerCounter<uint8_t> loaded(fname);
+        REQUIRE(loaded.overflow_enabled());
+        REQUIRE(loaded.bucket_count(aaaa) == 14700);
+        a.merge(loaded);
+        REQUIRE(a.bucket_count(aaaa) == 29400);
+        remove(fname.c_str());
+    }
 }
 
+TEST_CASE("KmerCounter log counters", "[KmerCounter]") {
+    // 1000 reads of 147 AAAA k-mers each, and one CCCC
+    vector<string> reads(1000, string(150, 'A'));
+    reads.push_back("CCCC");
+    const size_t aaaa = KmerIterator("AAAA", 4).next_hashed() % 100;
+    const size_t cccc = KmerIterator("CCCC", 4).next_hashed() % 100;
+    const double truth = 147000;
+    // Counting is randomised, so fix the seed to keep the test repeatable
+    _thread_rand_seed(42);
+
+    SECTION("levels") {
+        const auto &tables = LogCounterTables::get();
+        bool all_ok = true;
+        for (unsigned int v = 1; v < 256; v++) {
+            all_ok &= tables.value[v] > tables.value[v - 1];
+            all_ok &= tables.encode(tables.value[v], 0) == v;
+        }
+        REQUIRE(all_ok);
+        REQUIRE(tables.value[255] > 1e6);
+    }
+
+    SECTION("estimates") {
+        // Average a few counters, as each has a relative error of ~16%
+        double sum = 0;
+        for (int i = 0; i < 20; i++) {
+            KmerCounter<uint8_t> ctr(4, 100);
+            ctr.set_counter_mode(COUNTER_LOG);
+            ctr.consume(reads);
+            REQUIRE(ctr.bucket_count(cccc) == 1);
+            REQUIRE(ctr.export_counts<uint32_t>()[cccc] == 1);
+            sum += ctr.export_counts<uint32_t>()[aaaa];
+        }
+        REQUIRE(fabs(sum / 20 - truth) < 0.15 * truth);
+        KmerCounter<uint16_t> wide(4, 100);
+        REQUIRE_THROWS_AS(wide.set_counter_mode(COUNTER_LOG), const invalid_argument &);
+    }
+
+    SECTION("threads and merge") {
+        const string fname = "/tmp/kmkm_test_log.fa";
+        _write_fasta(fname, reads);
+        for (auto mode: {PARALLEL_ATOMIC, PARALLEL_SHARDED, PARALLEL_RANGE}) {
+            double sum = 0;
+            for (int i = 0; i < 10; i++) {
+                KmerCounter<uint8_t> a(4, 100), b(4, 100);
+                a.set_counter_mode(COUNTER_LOG);
+                b.set_counter_mode(COUNTER_LOG);
+                a.set_parallel_mode(mode);
+                REQUIRE(a.consume_from(fname, 3) == reads.size());
+                REQUIRE(a.bucket_count(cccc) == 1);
+                b.consume(reads);
+                a.merge(b);
+                REQUIRE(a.bucket_count(cccc) == 2);
+                sum += a.bucket_count(aaaa);
+            }
+            REQUIRE(fabs(sum / 10 - 2 * truth) < 0.2 * 2 * truth);
+        }
+        remove(fname.c_str());
+    }
+}
+
+TEST_CASE("KmerCounter merge", "[KmerCounter]") {
+    KmerCounter<uint8_t> a(4, 100), b(4, 100);
+    for (int i = 0; i < 200; i++) {
+        a.consume("AAAA");
+        b.consume("AAAA");
+    }
+    a.consume("ACGT");
+    b.consume("CCCC");
+    a.merge(b);
+
+    KmerIterator aaaa("AAAA", 4), acgt("ACGT", 4), cccc("CCCC", 4);
+    REQUIRE(a.counts()[aaaa.next_hashed() % 100] == 255);
+    REQUIRE(a.counts()[acgt.next_hashed() % 100] == 1);
+    REQUIRE(a.counts()[cccc.next_hashed() % 100] == 1);
+    REQUIRE(a.nnz() == 3);
+
+    KmerCounter<uint8_t> c(5, 100);
+    REQUIRE_THROWS(a.merge(c));
+}
 
 
 // vim:set et sw=4 ts=4:
@@ -26,6 +26,18 @@ TEST_CASE("KmerIterator basics", "[KmerIterator]") {
         }
         REQUIRE(len == seq.size() - k + 1);
     }
+
+    SECTION("Scratch buffer") {
+        PackedSeq scratch;
+        for (const string seq: {"ACGTNACGTTGCA", "TTTTGGGG", "AC"}) {
+            KmerIterator own(seq, 3), reused(seq, scratch, 3);
+            REQUIRE(reused.size() == own.size());
+            while (!own.finished()) {
+                REQUIRE(reused.next() == own.next());
+            }
+            REQUIRE(reused.finished());
+        }
+    }
 }
 
 
@@ -63,6 +75,323 @@ TEST_CASE("kmer values", "[KmerIterator]") {
         const vector<uint64_t> expected {0b00011011, 0b01101100, 0b10110001, 0b01101100, 0b00011011};
         _value_test(ki, expected);
     }
+
+    SECTION("invalid nucleotides") {
+        KmerIterator ki("ACGTNACGTACNN", 4, false);
+        const vector<uint64_t> expected {0b00011011, 0b00011011, 0b01101100, 0b10110001};
+        size_t i = 0;
+        while(!ki.finished()) {
+            REQUIRE(ki.next() == expected[i++]);
+        }
+        REQUIRE(i == expected.size());
+    }
+}
+
+TEST_CASE("canonical k-mers match kmer_revcomp", "[KmerIterator]") {
+    string seq;
+    for (size_t i = 0; i < 200; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    seq[100] = 'N';
+    for (int k = 1; k < 32; k += 3) {
+        KmerIterator fwd(seq, k, false), can(seq, k, true);
+        bool all_ok = true;
+        while (!fwd.finished()) {
+            const uint64_t f = fwd.next();
+            all_ok &= can.next() == min(f, kmer_revcomp(f, k));
+        }
+        REQUIRE(can.finished());
+        REQUIRE(all_ok);
+    }
+}
+
+TEST_CASE("compile-time k", "[KmerIterator]") {
+    string seq;
+    for (size_t i = 0; i < 200; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    for (bool canonical: {false, true}) {
+        KmerIterator rt(seq, 21, canonical);
+        BasicKmerIterator<21> ct(seq, 21, canonical);
+        REQUIRE(ct.size() == rt.size());
+        bool all_ok = true;
+        while (!rt.finished()) {
+            all_ok &= ct.next() == rt.next();
+        }
+        REQUIRE(ct.finished());
+        REQUIRE(all_ok);
+    }
+    REQUIRE_THROWS(BasicKmerIterator<21>(seq, 31));
+}
+
+string _revcomp(const string &seq)
+{
+    string rc(seq.rbegin(), seq.rend());
+    for (auto &c: rc) {
+        c = "TGCAN"[string("ACGTN").find(c)];
+    }
+    return rc;
+}
+
+/* n reads of 150 pseudo-random bases, about one in ten of them N */
+vector<string> _random_reads(size_t n)
+{
+    vector<string> reads;
+    for (size_t r = 0; r < n; r++) {
+        string seq;
+        for (size_t i = 0; i < 150; i++) {
+            seq += "ACGTN"[inthash64(r * 1000 + i) % 41 % 5];
+        }
+        reads.push_back(seq);
+    }
+    return reads;
+}
+
+/* Writes reads to a FASTA file, named by their index */
+void _write_fasta(const string &filename, const vector<string> &reads)
+{
+    ofstream fa(filename);
+    for (size_t r = 0; r < reads.size(); r++) {
+        fa << ">read" << r << "\n" << reads[r] << "\n";
+    }
+}
+
+TEST_CASE("wide k-mers", "[KmerIterator]") {
+    string seq;
+    for (size_t i = 0; i < 300; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+
+    SECTION("k=32 fits one word") {
+        KmerIterator fwd(seq, 32, false), can(seq, 32, true);
+        bool all_ok = true;
+        while (!fwd.finished()) {
+            const uint64_t f = fwd.next();
+            all_ok &= can.next() == min(f, kmer_revcomp(f, 32));
+        }
+        REQUIRE(all_ok);
+        REQUIRE_THROWS(KmerIterator(seq, 33));
+    }
+
+    SECTION("matches narrow k-mers for small k") {
+        for (bool canonical: {false, true}) {
+            KmerIterator narrow(seq, 21, canonical);
+            WideKmerIterator wide(seq, 21, canonical);
+            bool all_ok = true;
+            while (!narrow.finished()) {
+                const auto w = wide.next();
+                const uint64_t n = narrow.next();
+                all_ok &= w.w[0] == n && w.w[1] == 0;
+                all_ok &= kmer_hash(w) == kmer_hash(n);
+            }
+            REQUIRE(wide.finished());
+            REQUIRE(all_ok);
+        }
+    }
+
+    SECTION("canonical k-mers are strand independent") {
+        for (int k: {33, 41, 63, 64}) {
+            WideKmerIterator fwd(seq, k, true);
+            WideKmerIterator rev(_revcomp(seq), k, true);
+            vector<WideKmer<2>> f, r;
+            while (!fwd.finished()) f.push_back(fwd.next());
+            while (!rev.finished()) r.push_back(rev.next());
+            REQUIRE(f.size() == seq.size() - k + 1);
+            REQUIRE(r.size() == f.size());
+            bool all_ok = true;
+            for (size_t i = 0; i < f.size(); i++) {
+                all_ok &= f[i] == r[r.size() - 1 - i];
+                all_ok &= kmer_revcomp(kmer_revcomp(f[i], k), k) == f[i];
+            }
+            REQUIRE(all_ok);
+        }
+    }
+}
+
+TEST_CASE("NtHashIterator", "[NtHashIterator]") {
+    string seq;
+    for (size_t i = 0; i < 300; i++) {
+        seq += "ACGT"[inthash64(i) % 4];
+    }
+    seq[150] = 'N';
+
+    SECTION("rolling hash equals hash from scratch") {
+        for (int k: {1, 21, 64, 101}) {
+            NtHashIterator roll(seq, k, false);
+            size_t n = 0;
+            bool all_ok = true;
+            for (size_t i = 0; i + k <= seq.size(); i++) {
+                const string kmer = seq.substr(i, k);
+                if (kmer.find('N') != string::npos) continue;
+                NtHashIterator single(kmer, k, false);
+                all_ok &= roll.next_hashed() == single.next_hashed();
+                n++;
+            }
+            REQUIRE(roll.finished());
+            REQUIRE(all_ok);
+            REQUIRE(n > 0);
+        }
+    }
+
+    SECTION("canonical hashes are strand independent") {
+        for (int k: {21, 80}) {
+            NtHashIterator fwd(seq, k), rev(_revcomp(seq.substr(0, 150)), k);
+            vector<uint64_t> f, r;
+            while (!rev.finished()) r.push_back(rev.next_hashed());
+            for (size_t i = 0; i < r.size(); i++) f.push_back(fwd.next_hashed());
+            REQUIRE(r.size() == 150 - k + 1);
+            REQUIRE(vector<uint64_t>(f.rbegin(), f.rend()) == r);
+        }
+    }
+}
+
+TEST_CASE("batched hashes", "[KmerIterator]") {
+    string seq;
+    for (size_t i = 0; i < 300; i++) {
+        seq += "ACGTN"[inthash64(i) % 23 % 5];
+    }
+    KmerIterator single(seq, 11);
+    vector<uint64_t> expected;
+    while (!single.finished()) expected.push_back(single.next_hashed());
+
+    for (size_t n: {1, 7, 1000}) {
+        KmerIterator batched(seq, 11);
+        vector<uint64_t> got, buf(n);
+        size_t filled;
+        while ((filled = batched.next_hashed_batch(buf.data(), n)) > 0) {
+            got.insert(got.end(), buf.begin(), buf.begin() + filled);
+        }
+        REQUIRE(got == expected);
+    }
+}
+
+
+TEST_CASE("MinimizerIterator", "[MinimizerIterator]") {
+    string seq;
+    for (size_t i = 0; i < 2000; i++) {
+        seq += inthash64(i) % 50 == 0 ? 'N' : "ACGT"[inthash64(i) % 4];
+    }
+    const int k = 7;
+
+    // Hashes of valid k-mers by position
+    map<size_t, uint64_t> hashes;
+    KmerIterator ki(seq, k);
+    bool positions_ok = true;
+    while (!ki.finished()) {
+        const size_t pos = ki.position();
+        positions_ok &= seq.substr(pos, k).find('N') == string::npos;
+        hashes[pos] = ki.next_hashed();
+    }
+    REQUIRE(positions_ok);
+    REQUIRE(hashes.size() < seq.size() - k + 1);
+
+    for (int w: {1, 5, 15}) {
+        // Minimizers of windows from scratch, grouped into super-k-mers
+        vector<SuperKmer> expected;
+        for (size_t start = 0; start + w + k - 1 <= seq.size(); start++) {
+            uint64_t minimizer = ~UINT64_C(0);
+            bool valid = true;
+            for (size_t i = start; i < start + w; i++) {
+                valid &= hashes.count(i) > 0;
+                if (valid) minimizer = min(minimizer, hashes[i]);
+            }
+            if (!valid) continue;
+            if (!expected.empty() && expected.back().minimizer == minimizer &&
+                    expected.back().start + expected.back().length == start + w + k - 2) {
+                expected.back().length++;
+            } else {
+                expected.push_back(SuperKmer{minimizer, start, size_t(w + k - 1)});
+            }
+        }
+        REQUIRE(expected.size() > 10);
+
+        MinimizerIterator mi(seq, k, w);
+        bool all_ok = true;
+        size_t n = 0;
+        while (!mi.finished()) {
+            const SuperKmer sk = mi.next();
+            if (n < expected.size()) {
+                all_ok &= sk.minimizer == expected[n].minimizer;
+                all_ok &= sk.start == expected[n].start;
+                all_ok &= sk.length == expected[n].length;
+            }
+            n++;
+        }
+        REQUIRE(all_ok);
+        REQUIRE(n == expected.size());
+    }
+
+    SECTION("strand independent") {
+        MinimizerIterator fwd(seq, k, 10), rev(_revcomp(seq), k, 10);
+        multiset<uint64_t> fwd_min, rev_min;
+        while (!fwd.finished()) fwd_min.insert(fwd.next().minimizer);
+        while (!rev.finished()) rev_min.insert(rev.next().minimizer);
+        REQUIRE(fwd_min == rev_min);
+    }
+
+    SECTION("short and invalid") {
+        MinimizerIterator empty("ACGTNACGT", k, 2);
+        REQUIRE(empty.finished());
+        REQUIRE_THROWS_AS(MinimizerIterator("ACGT", k, 0), const invalid_argument &);
+    }
+}
+
+/* Mask of the 2-bit codes of valid nucleotides, given the invalid bits */
+uint64_t _valid_bits(uint32_t invalid)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < 32; i++) {
+        if (!((invalid >> i) & 1)) mask |= uint64_t(3) << (2 * i);
+    }
+    return mask;
+}
+
+TEST_CASE("PackedSeq encoding", "[PackedSeq]") {
+    // Longer than a block, mixed case, with invalid nucleotides spanning a
+    // block boundary
+    string seq;
+    const string alphabet = "ACGTacgtNn-.";
+    for (size_t i = 0; i < 150; i++) {
+        seq += alphabet[(i * 7 + i / 5) % alphabet.size()];
+    }
+    seq[31] = 'N';
+    seq[32] = 'n';
+    PackedSeq ps(seq.data(), seq.size());
+    REQUIRE(ps.size() == seq.size());
+
+    bool all_ok = true;
+    for (size_t i = 0; i < seq.size(); i++) {
+        const size_t pos = string("ACGT").find(toupper(seq[i]));
+        if (pos == string::npos) {
+            all_ok &= ps.invalid(i);
+        } else {
+            all_ok &= !ps.invalid(i) && ps.base(i) == pos;
+        }
+    }
+    REQUIRE(all_ok);
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    // Every encoder the CPU supports agrees with the scalar one
+    bool encoders_ok = true;
+    for (size_t start = 0; start + 32 <= seq.size(); start += 7) {
+        uint64_t packed, vpacked;
+        uint32_t invalid, vinvalid;
+        _encode_block32_scalar(seq.data() + start, packed, invalid);
+        if (__builtin_cpu_supports("ssse3")) {
+            _encode_block32_ssse3(seq.data() + start, vpacked, vinvalid);
+            encoders_ok &= vinvalid == invalid && ((vpacked ^ packed) & _valid_bits(invalid)) == 0;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            _encode_block32_avx2(seq.data() + start, vpacked, vinvalid);
+            encoders_ok &= vinvalid == invalid && ((vpacked ^ packed) & _valid_bits(invalid)) == 0;
+        }
+    }
+    REQUIRE(encoders_ok);
+#endif
+
+    PackedSeq ns("NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNA", 70);
+    REQUIRE(ns.next_valid(0) == 69);
+    REQUIRE(ns.next_valid(70) == 70);
 }
 
 